@@ -215,6 +215,11 @@ class Compiler : public ast::Visitor {
   void compileFunctionBody(ast::Node *node) {
     node->accept(this);
 
+    // all paths have returned already
+    if (bb == nullptr) {
+      return;
+    }
+
     if (result == nullptr) {
       result = llvm::ReturnInst::Create(context, zero, bb);
     } else if (not llvm::isa<llvm::ReturnInst>(result)) {
@@ -236,14 +241,14 @@ class Compiler : public ast::Visitor {
     result = nullptr;
     m = new llvm::Module("mila", context);
 
-    llvm::Function::Create(t_read,
-                           llvm::GlobalValue::ExternalLinkage,
-                           "read_",
-                           m)->setCallingConv(llvm::CallingConv::C);
-    llvm::Function::Create(t_write,
-                           llvm::GlobalValue::ExternalLinkage,
-                           "write_",
-                           m)->setCallingConv(llvm::CallingConv::C);
+    // the runtime only touches the standard streams, which the program cannot access otherwise
+    for (llvm::Function *runtime : {llvm::Function::Create(t_read, llvm::GlobalValue::ExternalLinkage, "read_", m),
+                                    llvm::Function::Create(t_write, llvm::GlobalValue::ExternalLinkage, "write_", m)}) {
+      runtime->setCallingConv(llvm::CallingConv::C);
+      runtime->addFnAttr(llvm::Attribute::InaccessibleMemOnly);
+      runtime->addFnAttr(llvm::Attribute::NoUnwind);
+      runtime->addFnAttr(llvm::Attribute::NoRecurse);
+    }
 
     c = new BlockContext(nullptr);
     compileDeclarations(module->declarations, true);
@@ -318,6 +323,7 @@ class Compiler : public ast::Visitor {
     bb = next;
     if (falseCase == nullptr and trueCase == nullptr) {
       next->eraseFromParent();
+      bb = nullptr;
       result = nullptr;
     } else {
       llvm::PHINode *phi = llvm::PHINode::Create(t_int, 2, "if_phi", bb);
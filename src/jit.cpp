@@ -2,6 +2,30 @@
 
 namespace mila {
 
-bool JIT::optimize = true;
+JIT::Level JIT::level = JIT::Level::O2;
+
+std::string JIT::passes;
+
+bool JIT::memoize = false;
+
+std::string JIT::profileGenerate;
+
+std::string JIT::profileUse;
+
+bool JIT::tiered = false;
+
+unsigned JIT::hotCalls = 1000;
+
+unsigned JIT::hotIterations = 10000;
+
+std::unique_ptr<JIT::Tiers> JIT::tiers_;
+
+llvm::Statistic Pipeline::groups = {"mila-pipeline", "groups", "Repeated groups run on a function"};
+llvm::Statistic Pipeline::iterations = {"mila-pipeline", "iterations", "Iterations of repeated groups"};
+llvm::Statistic Pipeline::runs = {"mila-pipeline", "runs", "Passes of repeated groups run"};
+llvm::Statistic Pipeline::skipped = {"mila-pipeline", "skipped", "Passes skipped on unchanged functions"};
+llvm::Statistic Pipeline::changes = {"mila-pipeline", "changes", "Passes of repeated groups which changed the code"};
+llvm::Statistic Pipeline::microseconds = {"mila-pipeline", "microseconds", "Microseconds spent in repeated groups"};
+llvm::Statistic Pipeline::exhausted = {"mila-pipeline", "exhausted", "Groups which ran out of budget"};
 
 }
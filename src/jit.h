@@ -1,15 +1,48 @@
 #ifndef JIT_H
 #define JIT_H
 
-#include <opt/dse.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "llvm.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "runtime.h"
 #include "compiler.h"
+#include "pipeline.h"
 
+#include "opt/adce.h"
+#include "opt/attributes.h"
 #include "opt/cp.h"
 #include "opt/dce.h"
 #include "opt/unrolling.h"
+#include "opt/vrp.h"
 #include "opt/dse.h"
+#include "opt/globals.h"
+#include "opt/gvn.h"
+#include "opt/indvars.h"
+#include "opt/inliner.h"
+#include "opt/ipcp.h"
+#include "opt/licm.h"
+#include "opt/mem2reg.h"
+#include "opt/memoize.h"
+#include "opt/pgo.h"
+#include "opt/reassociate.h"
+#include "opt/rotation.h"
+#include "opt/simplify.h"
+#include "opt/specialization.h"
+#include "opt/threading.h"
+#include "opt/tiering.h"
 
 namespace mila {
 
@@ -24,6 +57,9 @@ public:
       default LLVM resolution with the list of RIFT runtime functions.
     */
   uint64_t getSymbolAddress(const std::string &Name) override {
+    auto i = symbols.find(Name);
+    if (i != symbols.end())
+      return i->second;
     uint64_t addr = llvm::SectionMemoryManager::getSymbolAddress(Name);
     if (addr != 0)
       return addr;
@@ -31,61 +67,354 @@ public:
     // loading is broken)
     NAME_IS(read_);
     NAME_IS(write_);
+    NAME_IS(memo_lookup_);
+    NAME_IS(memo_store_);
+    NAME_IS(tier_hot_);
     llvm::report_fatal_error("Extern function '" + Name + "' couldn't be resolved!");
   }
+
+  /** Addresses of symbols defined by other code, such as the globals the baseline of tiered code owns. */
+  std::map<std::string, uint64_t> symbols;
 };
 
 class JIT {
 public:
 
-  static bool optimize;
+  /** Optimization levels, each selecting a pipeline and a code generation level. */
+  enum class Level {
+    O0,
+    O1,
+    O2,
+    O3,
+    Os
+  };
+
+  static Level level;
+
+  /** Exact pipeline to run instead of the one of the level, in the syntax of pipeline(). */
+  static std::string passes;
+
+  /** Memoizes pure recursive functions, off by default as the tables cost memory and time on every call. */
+  static bool memoize;
+
+  /** File the execution profile is written to once the program finishes, the code is instrumented if not empty. */
+  static std::string profileGenerate;
+
+  /** Profile of an earlier run of the program to optimize with, if not empty. */
+  static std::string profileUse;
+
+  /** Starts the program unoptimized and optimizes the functions which are called often in the background. */
+  static bool tiered;
+
+  /** Calls after which a function of tiered code is recompiled, at least one. */
+  static unsigned hotCalls;
+
+  /** Iterations after which a loop of main in tiered code is replaced on the stack, at least one. */
+  static unsigned hotIterations;
 
   typedef int (*MainPtr)();
 
+  /** The pipeline of a level.
+
+      Function passes are separated by commas and followed by a semicolon and the module passes, which run once all
+      functions are optimized. Function passes in parentheses are repeated until they stop changing the function.
+      Functions the module passes change are then run through the function passes again. The llvm pass stands for
+      the standard LLVM passes of the level.
+    */
+  static std::string pipeline(Level level) {
+    // memoization needs the purity inferred by the attributes
+    std::string attributes = memoize ? "attributes,memoize" : "attributes";
+    switch (level) {
+      case Level::O0:
+        return ";";
+      case Level::O1:
+        return "globals,mem2reg,(reassociate,simplify,cp,dce,dse);" + attributes;
+      case Level::O2:
+        return "globals,mem2reg,(reassociate,simplify,thread,cp,vrp,gvn,dce,adce,dse,licm,indvars,rotate,unroll);"
+            + attributes + ",ipcp,specialize,inline";
+      case Level::O3:
+        return "globals,mem2reg,(reassociate,simplify,thread,cp,vrp,gvn,dce,adce,dse,licm,indvars,rotate,unroll);"
+            + attributes + ",ipcp,specialize,inline,llvm";
+      case Level::Os:
+        // nothing which grows the code, the copies of jump threading and loop rotation included
+        return "globals,mem2reg,(reassociate,simplify,cp,vrp,gvn,dce,adce,dse,licm,indvars);" + attributes + ",ipcp";
+    }
+    return ";";
+  }
+
+  static llvm::CodeGenOpt::Level codeGenLevel(Level level) {
+    switch (level) {
+      case Level::O0:
+        return llvm::CodeGenOpt::None;
+      case Level::O1:
+        return llvm::CodeGenOpt::Less;
+      case Level::O3:
+        return llvm::CodeGenOpt::Aggressive;
+      default:
+        return llvm::CodeGenOpt::Default;
+    }
+  }
+
   static MainPtr compile(llvm::Function *main) {
+    // the context is not to be shared with the background compilation of the previous program
+    finish();
     llvm::Module *m = main->getParent();
+    applyProfile(m);
+    if (tiered) {
+      return compileTiered(main);
+    }
+    optimize(m);
+    llvm::ExecutionEngine *engine = emit(m, codeGenLevel(level), std::unique_ptr<MemoryManager>(new MemoryManager()));
+    return reinterpret_cast<MainPtr>(engine->getPointerToFunction(main));
+  }
 
-    if (optimize == true) {
-      // create function pass manager
-      auto pm = llvm::legacy::FunctionPassManager(m);
-      // add passes
+  /** Stops the background compilation of tiered code, waiting for the function being compiled. The functions which
+      were not switched to optimized code yet keep running unoptimized.
+    */
+  static void finish() {
+    tiers_.reset();
+  }
 
-      // CONSTANT PROPAGATION
-      pm.add(new cp::Analysis());
-      pm.add(new cp::Optimization());
+private:
 
-      // DEAD CODE ELIMINATION
-      pm.add(new dce::Optimization());
+  /** The background compilation of tiered code.
 
-      // DEAD STORE ELIMINATION
-      pm.add(new dse::Optimization());
+      The first function to become hot gets the whole program optimized by the pipeline of the level, as the
+      interprocedural passes need all of it, and compiled with its code generation level. Each hot function is then
+      switched to its optimized code in its record, the optimized functions call each other directly. Calls already
+      running in the baseline finish there. Hot loops of main are the same, except that their optimized code is the
+      continuation of main, which the baseline of main enters at the next iteration.
+    */
+  class Tiers {
+   public:
+    Tiers(std::unique_ptr<llvm::Module> optimized, std::unique_ptr<MemoryManager> mm) :
+        optimized_(std::move(optimized)),
+        mm_(std::move(mm)),
+        engine_(nullptr),
+        failed_(false),
+        stopping_(false),
+        worker_(&Tiers::run, this) {
+    }
 
-      // LOOP UNROLLING
-      pm.add(llvm::createLoopSimplifyPass());
-      pm.add(new llvm::LoopInfoWrapperPass());
-      pm.add(new llvm::ScalarEvolutionWrapperPass());
+    ~Tiers() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      ready_.notify_one();
+      worker_.join();
+    }
+
+    /** Queues the function for its switch, called by the program. */
+    void hot(int function) {
+      ++tiering::Instrumentation::becameHot;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hot_.push_back(function);
+      }
+      ready_.notify_one();
+    }
+
+   private:
+
+    void run() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+        ready_.wait(lock, [this]() { return stopping_ or not hot_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        int function = hot_.front();
+        hot_.pop_front();
+        lock.unlock();
+        switchToOptimized(function);
+        lock.lock();
+      }
+    }
+
+    void switchToOptimized(int function) {
+      if (engine_ == nullptr and not failed_) {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+        try {
+          llvm::Module *m = optimized_.get();
+          optimize(m);
+          engine_ = emit(optimized_.release(), codeGenLevel(level), std::move(mm_));
+        } catch (std::exception const &e) {
+          // the program goes on in the baseline
+          std::cerr << "Tiered compilation failed: " << e.what() << std::endl;
+          failed_ = true;
+        }
+        tiering::Instrumentation::microseconds +=
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+      }
+      if (engine_ == nullptr) {
+        return;
+      }
+      tier::Function &record = tier::get(function);
+      uint64_t address = engine_->getFunctionAddress(record.name);
+      if (address != 0) {
+        // released so that the callers which acquire the address see the code it points to
+        record.code.store(reinterpret_cast<void *>(address), std::memory_order_release);
+        ++tiering::Instrumentation::switched;
+      }
+    }
+
+    std::unique_ptr<llvm::Module> optimized_;
+    std::unique_ptr<MemoryManager> mm_;
+    llvm::ExecutionEngine *engine_;
+    bool failed_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<int> hot_;
+    bool stopping_;
+    std::thread worker_;
+  };
+
+  static std::unique_ptr<Tiers> tiers_;
+
+  /** Compiles the baseline of tiered code and prepares the optimized code, which is compiled once needed. */
+  static MainPtr compileTiered(llvm::Function *main) {
+    llvm::Module *m = main->getParent();
+    // the optimized code starts from the program as the compiler emitted it
+    std::unique_ptr<llvm::Module> optimized = llvm::CloneModule(m);
+
+    std::map<std::string, int> functions;
+    {
+      llvm::legacy::PassManager pm;
+      tiering::Instrumentation *instrumentation = new tiering::Instrumentation(hotCalls);
+      pm.add(instrumentation);
+      pm.run(*m);
+      functions = instrumentation->functions();
+    }
+    // main is entered only once, its loops are continued in the optimized code instead
+    {
+      llvm::legacy::FunctionPassManager pm(m);
       pm.add(new llvm::DominatorTreeWrapperPass());
-      pm.add(new llvm::AssumptionCacheTracker());
-      pm.add(new unrolling::Optimization());
+      pm.add(new llvm::LoopInfoWrapperPass());
+      tiering::OnStackReplacement *osr = new tiering::OnStackReplacement(hotIterations);
+      pm.add(osr);
+      pm.run(*main);
+      for (tiering::OnStackReplacement::Entry const &e : osr->entries()) {
+        tiering::OnStackReplacement::continuation(optimized->getFunction("main"), e.header);
+      }
+    }
+    // the baseline is generated as fast as possible
+    llvm::ExecutionEngine *engine =
+        emit(m, llvm::CodeGenOpt::None, std::unique_ptr<MemoryManager>(new MemoryManager()));
+    for (auto const &f : functions) {
+      tier::get(f.second).code = engine->getPointerToFunction(m->getFunction(f.first));
+    }
+
+    // both tiers work on the globals of the baseline
+    std::unique_ptr<MemoryManager> mm(new MemoryManager());
+    for (llvm::GlobalVariable &g : optimized->globals()) {
+      if (not g.isConstant()) {
+        mm->symbols[g.getName().str()] = engine->getGlobalValueAddress(g.getName().str());
+        g.setInitializer(nullptr);
+        g.setLinkage(llvm::GlobalValue::ExternalLinkage);
+      }
+    }
+    tiers_.reset(new Tiers(std::move(optimized), std::move(mm)));
+    tier::onHot([](int function) {
+      if (tiers_ != nullptr) {
+        tiers_->hot(function);
+      }
+    });
+    return reinterpret_cast<MainPtr>(engine->getPointerToFunction(main));
+  }
+
+  /** Collects or applies the profile on the code as the compiler emitted it, where the blocks match. */
+  static void applyProfile(llvm::Module *m) {
+    if (not profileGenerate.empty() or not profileUse.empty()) {
+      llvm::legacy::PassManager ppm;
+      if (not profileGenerate.empty()) {
+        ppm.add(new pgo::Instrumentation());
+      }
+      if (not profileUse.empty()) {
+        ppm.add(new pgo::Annotation(profile::read(profileUse)));
+      }
+      ppm.run(*m);
+    }
+  }
 
-      // run the pass manager on all functions in the module
+  /** Runs the pipeline of the level, or the exact one if given, on the module. */
+  static void optimize(llvm::Module *m) {
+    std::string p = passes.empty() ? pipeline(level) : passes;
+    size_t split = p.find(';');
+    std::vector<std::string> functionPasses = names(p.substr(0, split));
+    std::vector<std::string> modulePasses = names(split == std::string::npos ? "" : p.substr(split + 1));
+
+    Pipeline pm(m);
+    bool repeated = false;
+    for (std::string name : functionPasses) {
+      if (name.front() == '(') {
+        if (repeated) {
+          throw Exception(STR("Nested group in pipeline " << p));
+        }
+        name.erase(0, 1);
+        repeated = true;
+      }
+      bool last = not name.empty() and name.back() == ')';
+      if (last) {
+        if (not repeated) {
+          throw Exception(STR("Group closed but not opened in pipeline " << p));
+        }
+        name.pop_back();
+      }
+      if (name.empty() or name.front() == '(' or name.back() == ')') {
+        throw Exception(STR("Invalid group in pipeline " << p));
+      }
+      addFunctionPass(pm.add(name, repeated), name);
+      repeated = repeated and not last;
+    }
+    if (repeated) {
+      throw Exception(STR("Group not closed in pipeline " << p));
+    }
+    if (not pm.empty()) {
+      // run the pipeline on all functions in the module
       for (llvm::Function & f : *m) {
+        if (not f.isDeclaration()) {
           pm.run(f);
-        // debug print
-        //f.dump();
+        }
       }
     }
 
+    if (not modulePasses.empty()) {
+      auto mpm = llvm::legacy::PassManager();
+      std::vector<std::function<std::vector<llvm::Function *> const &()>> changes;
+      for (std::string const &name : modulePasses) {
+        addModulePass(mpm, name, changes);
+      }
+      mpm.run(*m);
+
+      // clean up after the propagated constants, clones and inlined bodies
+      if (not pm.empty()) {
+        llvm::SmallSetVector<llvm::Function *, 8> changed;
+        for (auto const &c : changes) {
+          changed.insert(c().begin(), c().end());
+        }
+        for (llvm::Function * f : changed) {
+          pm.run(*f);
+        }
+      }
+    }
+  }
 
+  /** Generates the machine code of the module, which the returned engine owns from now on. */
+  static llvm::ExecutionEngine *emit(llvm::Module *m, llvm::CodeGenOpt::Level codeGen,
+                                     std::unique_ptr<MemoryManager> mm) {
     std::string err;
 
     llvm::TargetOptions opts;
     llvm::ExecutionEngine *engine =
         llvm::EngineBuilder(std::unique_ptr<llvm::Module>(m))
             .setErrorStr(&err)
-            .setMCJITMemoryManager(std::unique_ptr<llvm::RTDyldMemoryManager>(new MemoryManager()))
+            .setMCJITMemoryManager(std::unique_ptr<llvm::RTDyldMemoryManager>(mm.release()))
             .setEngineKind(llvm::EngineKind::JIT)
             .setTargetOptions(opts)
+            .setOptLevel(codeGen)
             .create();
     if (engine == nullptr)
       throw CompilerError(STR("Could not create ExecutionEngine: " << err));
@@ -96,7 +425,153 @@ public:
         .setMCJITMemoryManager(std::unique_ptr<MemoryManager>(new MemoryManager()))
         .create();
     engine->finalizeObject(); */
-    return reinterpret_cast<MainPtr>(engine->getPointerToFunction(main));
+    return engine;
+  }
+
+  static std::vector<std::string> names(std::string const &list) {
+    std::vector<std::string> result;
+    std::stringstream ss(list);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+      if (not name.empty()) {
+        result.push_back(name);
+      }
+    }
+    return result;
+  }
+
+  /** Standard LLVM passes matching the level. */
+  static void configure(llvm::PassManagerBuilder &builder) {
+    switch (level) {
+      case Level::O0:
+        builder.OptLevel = 0;
+        break;
+      case Level::O1:
+        builder.OptLevel = 1;
+        break;
+      case Level::O3:
+        builder.OptLevel = 3;
+        break;
+      default:
+        builder.OptLevel = 2;
+        break;
+    }
+    builder.SizeLevel = level == Level::Os ? 1 : 0;
+  }
+
+  /** Adds the pass with the given name together with the analyses it requires, each pass gets a pass manager of its
+      own so that it can run without the others.
+    */
+  static void addFunctionPass(llvm::legacy::FunctionPassManager &pm, std::string const &name) {
+    if (name == "globals") {
+      // PROMOTION OF GLOBAL VARIABLES TO LOCALS, which mem2reg then promotes further
+      pm.add(new globals::Optimization());
+    } else if (name == "mem2reg") {
+      // PROMOTION OF LOCAL VARIABLES TO REGISTERS
+      pm.add(new llvm::DominatorTreeWrapperPass());
+      pm.add(new mem2reg::Optimization());
+    } else if (name == "reassociate") {
+      // REASSOCIATION
+      pm.add(new reassociate::Optimization());
+    } else if (name == "simplify") {
+      // ALGEBRAIC SIMPLIFICATION
+      pm.add(new simplify::Optimization());
+    } else if (name == "thread") {
+      // JUMP THREADING
+      pm.add(new threading::Optimization());
+    } else if (name == "cp") {
+      // CONSTANT PROPAGATION
+      pm.add(new cp::Analysis());
+      pm.add(new cp::Optimization());
+    } else if (name == "vrp") {
+      // VALUE RANGE PROPAGATION
+      pm.add(new llvm::LoopInfoWrapperPass());
+      pm.add(new vrp::Analysis());
+      pm.add(new vrp::Optimization());
+    } else if (name == "gvn") {
+      // GLOBAL VALUE NUMBERING
+      pm.add(new llvm::DominatorTreeWrapperPass());
+      pm.add(new gvn::Optimization());
+    } else if (name == "dce") {
+      // DEAD CODE ELIMINATION
+      pm.add(new dce::Optimization());
+    } else if (name == "adce") {
+      pm.add(new llvm::PostDominatorTreeWrapperPass());
+      pm.add(new llvm::ScalarEvolutionWrapperPass());
+      pm.add(new adce::Optimization());
+    } else if (name == "dse") {
+      // DEAD STORE ELIMINATION
+      pm.add(new dse::Optimization());
+    } else if (name == "licm") {
+      // LOOP INVARIANT CODE MOTION
+      pm.add(llvm::createLoopSimplifyPass());
+      pm.add(new llvm::DominatorTreeWrapperPass());
+      pm.add(new llvm::LoopInfoWrapperPass());
+      pm.add(new vrp::Analysis());
+      pm.add(new licm::Optimization());
+    } else if (name == "indvars") {
+      // INDUCTION VARIABLE SIMPLIFICATION
+      pm.add(new llvm::ScalarEvolutionWrapperPass());
+      pm.add(new llvm::DominatorTreeWrapperPass());
+      pm.add(new indvars::Optimization());
+    } else if (name == "rotate") {
+      // LOOP ROTATION
+      pm.add(llvm::createLoopSimplifyPass());
+      pm.add(new llvm::DominatorTreeWrapperPass());
+      pm.add(new llvm::LoopInfoWrapperPass());
+      pm.add(new rotation::Optimization());
+    } else if (name == "unroll") {
+      // LOOP UNROLLING
+      pm.add(llvm::createLoopSimplifyPass());
+      pm.add(new llvm::ScalarEvolutionWrapperPass());
+      pm.add(new llvm::AssumptionCacheTracker());
+      pm.add(new unrolling::Optimization());
+    } else if (name == "llvm") {
+      llvm::PassManagerBuilder builder;
+      configure(builder);
+      builder.populateFunctionPassManager(pm);
+    } else {
+      throw Exception(STR("Unknown function pass " << name));
+    }
+  }
+
+  /** Adds the module pass with the given name, remembering how to get the functions it changes. */
+  static void addModulePass(llvm::legacy::PassManager &mpm, std::string const &name,
+                            std::vector<std::function<std::vector<llvm::Function *> const &()>> &changes) {
+    if (name == "attributes") {
+      // ATTRIBUTE INFERENCE, the callers of functions with new attributes are optimized again
+      attributes::Optimization *attributes = new attributes::Optimization();
+      mpm.add(attributes);
+      changes.push_back([attributes]() -> std::vector<llvm::Function *> const & { return attributes->changed(); });
+    } else if (name == "memoize") {
+      // MEMOIZATION, before the wrappers could be inlined or specialized away
+      memoize::Optimization *memoization = new memoize::Optimization();
+      mpm.add(memoization);
+      changes.push_back([memoization]() -> std::vector<llvm::Function *> const & { return memoization->changed(); });
+    } else if (name == "ipcp") {
+      // INTERPROCEDURAL CONSTANT PROPAGATION
+      ipcp::Optimization *ipcp = new ipcp::Optimization();
+      mpm.add(ipcp);
+      changes.push_back([ipcp]() -> std::vector<llvm::Function *> const & { return ipcp->changed(); });
+    } else if (name == "specialize") {
+      // FUNCTION SPECIALIZATION
+      specialization::Optimization *specialization = new specialization::Optimization();
+      mpm.add(specialization);
+      changes.push_back([specialization]() -> std::vector<llvm::Function *> const & {
+        return specialization->changed();
+      });
+    } else if (name == "inline") {
+      // INLINING, the callees are already optimized so their sizes are realistic
+      inliner::Optimization *inliner = new inliner::Optimization();
+      mpm.add(inliner);
+      changes.push_back([inliner]() -> std::vector<llvm::Function *> const & { return inliner->changed(); });
+    } else if (name == "llvm") {
+      llvm::PassManagerBuilder builder;
+      configure(builder);
+      builder.populateModulePassManager(mpm);
+    } else {
+      throw Exception(STR("Unknown module pass " << name));
+    }
   }
 };
 
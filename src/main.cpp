@@ -1,11 +1,13 @@
 /* main.c */
 /* syntakticky analyzator */
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <tests/tests.h>
 
 #include "llvm.h"
+#include "llvm/Support/YAMLTraits.h"
 
 #include "mila/scanner.h"
 #include "mila/ast.h"
@@ -22,25 +24,72 @@ int main(int argc, char const *argv[]) {
   LLVMInitializeNativeAsmParser();
 
   //tests();
-  JIT::optimize = true;
 
   try {
     char const *filename = nullptr;
     bool verbose = false;
     char const *emitir = nullptr;
+    char const *stats = nullptr;
+    char const *remarks = nullptr;
 
     for (int i = 1; i < argc; ++i) {
       if (strncmp(argv[i], "--verbose", 10) == 0) {
         verbose = true;
+      } else if (strcmp(argv[i], "-O0") == 0) {
+        JIT::level = JIT::Level::O0;
+      } else if (strcmp(argv[i], "-O1") == 0) {
+        JIT::level = JIT::Level::O1;
+      } else if (strcmp(argv[i], "-O2") == 0) {
+        JIT::level = JIT::Level::O2;
+      } else if (strcmp(argv[i], "-O3") == 0) {
+        JIT::level = JIT::Level::O3;
+      } else if (strcmp(argv[i], "-Os") == 0) {
+        JIT::level = JIT::Level::Os;
+      } else if (strncmp(argv[i], "--passes=", 9) == 0) {
+        JIT::passes = argv[i] + 9;
+      } else if (strncmp(argv[i], "--memoize", 10) == 0) {
+        JIT::memoize = true;
+      } else if (strncmp(argv[i], "--profile-generate=", 19) == 0) {
+        JIT::profileGenerate = argv[i] + 19;
+      } else if (strncmp(argv[i], "--profile-use=", 14) == 0) {
+        JIT::profileUse = argv[i] + 14;
+      } else if (strcmp(argv[i], "--tiered") == 0) {
+        JIT::tiered = true;
+      } else if (strncmp(argv[i], "--tiered=", 9) == 0) {
+        JIT::tiered = true;
+        JIT::hotCalls = static_cast<unsigned>(std::max(1, atoi(argv[i] + 9)));
+        char const *iterations = strchr(argv[i] + 9, ',');
+        if (iterations != nullptr) {
+          JIT::hotIterations = static_cast<unsigned>(std::max(1, atoi(iterations + 1)));
+        }
+      } else if (strcmp(argv[i], "--stats") == 0) {
+        stats = "text";
+      } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+        stats = argv[i] + 8;
+        if (strcmp(stats, "text") != 0 and strcmp(stats, "json") != 0) {
+          throw Exception(STR("Unknown statistics format " << stats));
+        }
+      } else if (strncmp(argv[i], "--remarks=", 10) == 0) {
+        remarks = argv[i] + 10;
       } else if (strncmp(argv[i], "--emit", 7) == 0) {
         emitir = argv[++i];
       } else if (filename != nullptr) {
-        throw Exception("Invalid usage! mila+ [--verbose] [--emit filename] filename");
+        throw Exception("Invalid usage! mila+ [--verbose] [-O0|-O1|-O2|-O3|-Os] [--passes=pipeline] [--memoize] "
+                        "[--profile-generate=filename] [--profile-use=filename] [--tiered[=calls[,iterations]]] "
+                        "[--stats[=text|json]] [--remarks=filename] [--emit filename] filename");
       } else {
         filename = argv[i];
       }
     }
 
+    // the passes count into the statistics only when they are enabled before the first pass runs
+    if (verbose and stats == nullptr) {
+      stats = "text";
+    }
+    if (stats != nullptr) {
+      llvm::EnableStatistics(false);
+    }
+
     ast::Module *m = Parser::parse(Scanner::file(filename));
     if (verbose) {
       std::cout << "###### INPUT FILE ######" << std::endl;
@@ -53,16 +102,46 @@ int main(int argc, char const *argv[]) {
       f->getParent()->dump();
     }
 
+    // optimization remarks of all passes are serialized as YAML documents
+    llvm::LLVMContext &context = f->getContext();
+    std::unique_ptr<llvm::raw_fd_ostream> remarksFile;
+    if (remarks != nullptr) {
+      std::error_code error;
+      remarksFile.reset(new llvm::raw_fd_ostream(remarks, error, llvm::sys::fs::OpenFlags::F_None));
+      if (error) {
+        throw Exception(STR("Cannot open " << remarks << ": " << error.message()));
+      }
+      context.setDiagnosticsOutputFile(std::unique_ptr<llvm::yaml::Output>(new llvm::yaml::Output(*remarksFile)));
+    }
+
     if (emitir != nullptr) {
       std::error_code error;
       llvm::raw_fd_ostream o(emitir, error, llvm::sys::fs::OpenFlags::F_None);
       llvm::WriteBitcodeToFile(f->getParent(), o);
     } else {
       JIT::compile(f)();
+      JIT::finish();
+      if (not JIT::profileGenerate.empty()) {
+        profile::write(JIT::profileGenerate);
+      }
+      if (JIT::memoize) {
+        std::cout << "###### MEMOIZATION ######" << std::endl;
+        memo::report(std::cout);
+      }
       if (verbose) {
         std::cout << "###### POST-JIT ######" << std::endl;
         f->getParent()->dump();
       }
+      // on stderr like the statistics of LLVM's tools, so that they do not mix with the program's output
+      if (stats != nullptr and strcmp(stats, "json") == 0) {
+        llvm::PrintStatisticsJSON(llvm::errs());
+      } else if (stats != nullptr) {
+        llvm::PrintStatistics(llvm::errs());
+      }
+    }
+    if (remarks != nullptr) {
+      // flushes the YAML stream before the file is closed
+      context.setDiagnosticsOutputFile(nullptr);
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,227 @@
+#ifndef OPT_AGGRESSIVE_DEAD_CODE_H
+#define OPT_AGGRESSIVE_DEAD_CODE_H
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/CFG.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace adce {
+
+/** Aggressive dead code elimination.
+
+    Unlike dce, which keeps every terminator, only instructions whose effect can be observed are assumed live: returns,
+    calls and stores to anything but local variables. Liveness flows to the operands of live instructions, to the
+    stores a live load may read and, through control dependence computed from the post-dominator tree, to the branches
+    deciding whether a live block executes. Conditional branches which stay dead are replaced by a jump to their
+    nearest live post-dominator, which removes dead conditionals and whole dead loops together with their blocks.
+    Removing a loop which never terminates would change the program, so the exits of loops are live unless scalar
+    evolution computes how many times they iterate, like indvars requires for the loops it deletes.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic branches;
+  static llvm::Statistic removed;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "AggressiveDeadCodeElimination";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::PostDominatorTreeWrapperPass>();
+    au.addRequired<llvm::LoopInfoWrapperPass>();
+    au.addRequired<llvm::ScalarEvolutionWrapperPass>();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    llvm::PostDominatorTree &pdt = getAnalysis<llvm::PostDominatorTreeWrapperPass>().getPostDomTree();
+    alive_.clear();
+    liveBlocks_.clear();
+    list_.clear();
+    computeControlDependence(f, pdt);
+
+    // Collect root instr that are live
+    for (llvm::Instruction &instr : llvm::instructions(f)) {
+      if (isRoot(&instr, pdt)) {
+        markLive(&instr);
+      }
+    }
+
+    // Loops not known to terminate keep their exits
+    llvm::ScalarEvolution &se = getAnalysis<llvm::ScalarEvolutionWrapperPass>().getSE();
+    for (llvm::Loop *l : getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo().getLoopsInPreorder()) {
+      if (llvm::isa<llvm::SCEVCouldNotCompute>(se.getBackedgeTakenCount(l))) {
+        llvm::SmallVector<llvm::BasicBlock *, 4> exiting;
+        l->getExitingBlocks(exiting);
+        for (llvm::BasicBlock *b : exiting) {
+          markLive(b->getTerminator());
+        }
+      }
+    }
+
+    // Propagate to operands, stores and controlling branches
+    while (not list_.empty()) {
+      llvm::Instruction *currInstr = list_.pop_back_val();
+      for (llvm::Use &ops : currInstr->operands()) {
+        if (llvm::Instruction *inst = llvm::dyn_cast<llvm::Instruction>(ops)) {
+          markLive(inst);
+        }
+      }
+      if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(currInstr)) {
+        // the value depends on which edge was taken
+        for (llvm::BasicBlock *pred : phi->blocks()) {
+          markLive(pred->getTerminator());
+        }
+      } else if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(currInstr)) {
+        if (llvm::isa<llvm::AllocaInst>(load->getPointerOperand())) {
+          for (llvm::User *u : load->getPointerOperand()->users()) {
+            if (llvm::isa<llvm::StoreInst>(u)) {
+              markLive(llvm::cast<llvm::Instruction>(u));
+            }
+          }
+        }
+      }
+    }
+
+    bool changed = false;
+
+    // Dead branches jump to where their paths join again
+    for (llvm::BasicBlock &b : f) {
+      llvm::TerminatorInst *t = b.getTerminator();
+      if (alive_.count(t) or t->getNumSuccessors() < 2) {
+        continue;
+      }
+      llvm::BasicBlock *target = livePostDominator(&b, pdt);
+      assert(target != nullptr and "Branches without post-dominator are roots");
+      bool kept = false;
+      for (llvm::BasicBlock *succ : llvm::successors(&b)) {
+        if (succ == target and not kept) {
+          kept = true;
+          continue;
+        }
+        succ->removePredecessor(&b, true);
+      }
+      llvm::BranchInst::Create(target, t);
+      t->eraseFromParent();
+      ++branches;
+      for (auto i = target->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+        if (phi->getBasicBlockIndex(&b) == -1) {
+          phi->addIncoming(llvm::UndefValue::get(phi->getType()), &b);
+        }
+      }
+      changed = true;
+    }
+
+    // Dead if not proven otherwise
+    llvm::SmallVector<llvm::Instruction *, 32> dead;
+    for (llvm::Instruction &i : llvm::instructions(f)) {
+      if (not i.isTerminator() and not alive_.count(&i)) {
+        dead.push_back(&i);
+        i.dropAllReferences();
+      }
+    }
+    for (llvm::Instruction *i : dead) {
+      i->eraseFromParent();
+    }
+    removed += dead.size();
+
+    return cp::Optimization::removeUnreachableBlocks(f) or changed or not dead.empty();
+  }
+
+ private:
+
+  /** A block is control dependent on the branches in its post-dominance frontier. For every edge leaving a branch,
+      the blocks on the post-dominator tree path from the edge's target up to the branch's post-dominator are.
+    */
+  void computeControlDependence(llvm::Function &f, llvm::PostDominatorTree &pdt) {
+    controllers_.clear();
+    for (llvm::BasicBlock &b : f) {
+      llvm::DomTreeNode *node = pdt.getNode(&b);
+      if (b.getTerminator()->getNumSuccessors() < 2 or node == nullptr) {
+        continue;
+      }
+      llvm::DomTreeNode *ipdom = node->getIDom();
+      for (llvm::BasicBlock *succ : llvm::successors(&b)) {
+        for (llvm::DomTreeNode *runner = pdt.getNode(succ);
+             runner != nullptr and runner != ipdom and runner->getBlock() != nullptr;
+             runner = runner->getIDom()) {
+          controllers_[runner->getBlock()].insert(&b);
+        }
+      }
+    }
+  }
+
+  /** Returns, calls and stores to anything but local variables are observable. Branches which do not lead to a
+      single post-dominator may decide whether the function returns at all, so they are kept too.
+    */
+  bool isRoot(llvm::Instruction *ins, llvm::PostDominatorTree &pdt) const {
+    if (llvm::isa<llvm::ReturnInst>(ins)) {
+      return true;
+    }
+    if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
+      return not llvm::isa<llvm::AllocaInst>(store->getPointerOperand());
+    }
+    if (ins->isTerminator()) {
+      return ins->getNumSuccessors() > 1 and livePostDominatorCandidate(ins->getParent(), pdt) == nullptr;
+    }
+    return ins->mayHaveSideEffects();
+  }
+
+  static llvm::DomTreeNode *livePostDominatorCandidate(llvm::BasicBlock *b, llvm::PostDominatorTree &pdt) {
+    llvm::DomTreeNode *node = pdt.getNode(b);
+    if (node == nullptr or node->getIDom() == nullptr or node->getIDom()->getBlock() == nullptr) {
+      return nullptr;
+    }
+    return node->getIDom();
+  }
+
+  /** First block with live code on the post-dominator tree path up from the block. */
+  llvm::BasicBlock *livePostDominator(llvm::BasicBlock *b, llvm::PostDominatorTree &pdt) const {
+    for (llvm::DomTreeNode *runner = livePostDominatorCandidate(b, pdt);
+         runner != nullptr and runner->getBlock() != nullptr;
+         runner = runner->getIDom()) {
+      if (liveBlocks_.count(runner->getBlock())) {
+        return runner->getBlock();
+      }
+    }
+    return nullptr;
+  }
+
+  void markLive(llvm::Instruction *ins) {
+    if (not alive_.insert(ins).second) {
+      return;
+    }
+    list_.push_back(ins);
+    llvm::BasicBlock *b = ins->getParent();
+    if (not liveBlocks_.insert(b).second) {
+      return;
+    }
+    auto i = controllers_.find(b);
+    if (i != controllers_.end()) {
+      for (llvm::BasicBlock *c : i->second) {
+        markLive(c->getTerminator());
+      }
+    }
+  }
+
+  llvm::DenseMap<llvm::BasicBlock *, llvm::SmallSetVector<llvm::BasicBlock *, 4>> controllers_;
+  llvm::SmallPtrSet<llvm::Instruction *, 32> alive_;
+  llvm::SmallPtrSet<llvm::BasicBlock *, 16> liveBlocks_;
+  llvm::SmallVector<llvm::Instruction *, 32> list_;
+};
+
+}
+}
+#endif
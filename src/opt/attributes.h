@@ -0,0 +1,203 @@
+#ifndef OPT_ATTRIBUTES_H
+#define OPT_ATTRIBUTES_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+
+namespace mila {
+
+namespace attributes {
+
+/** Infers attributes of user functions.
+
+    The strongly connected components of the call graph are visited bottom-up so that the attributes of the callees
+    are known. A function which touches no globals and calls only such functions is readnone, one that also loads
+    globals is readonly, and one whose only effects come from calls to read_ and write_ accesses only inaccessible
+    memory. As the LLVM version we use cannot say that a function returns, calls to readnone and readonly functions
+    whose results are unused are deleted, so those two are only given to functions which always return: their code
+    has no cycles, they are not recursive and they only call functions which always return. Functions which touch no
+    memory are marked as mila-pure whether they return or not, which is all memoization needs. Mila has no exceptions,
+    so every function which only calls nounwind functions is nounwind, and functions outside of a cycle in the call
+    graph are norecurse. The callers of functions which got new attributes are reported as changed, the function
+    passes which ran before the inference can do more with their calls now.
+  */
+class Optimization : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  static llvm::Statistic readnone;
+  static llvm::Statistic readonly;
+  static llvm::Statistic inaccessiblememonly;
+  static llvm::Statistic nounwind;
+  static llvm::Statistic norecurse;
+
+  /** String attribute of functions which touch no memory, but may not return. */
+  static constexpr char const *PURE = "mila-pure";
+
+  Optimization() :
+      llvm::ModulePass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "AttributeInference";
+  }
+
+  /** Callers of the functions whose attributes changed in the last run. */
+  std::vector<llvm::Function *> const &changed() const {
+    return changed_;
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    returns_.clear();
+    changed_.clear();
+    callers_.clear();
+    bool changed = false;
+    llvm::CallGraph cg(m);
+    for (auto i = llvm::scc_begin(&cg); not i.isAtEnd(); ++i) {
+      std::vector<llvm::Function *> scc;
+      bool defined = true;
+      for (llvm::CallGraphNode *node : *i) {
+        llvm::Function *f = node->getFunction();
+        if (f == nullptr or f->isDeclaration()) {
+          defined = false;
+        } else {
+          scc.push_back(f);
+        }
+      }
+      if (defined and not scc.empty()) {
+        changed = inferSCC(scc, i.hasLoop()) or changed;
+      }
+    }
+    return changed;
+  }
+
+ private:
+
+  enum Memory {
+    None = 0,
+    ReadsGlobals = 1,
+    WritesGlobals = 2,
+    Inaccessible = 4,
+    Unknown = 8
+  };
+
+  /** Memory accessed by a call to a function outside of the component. */
+  static unsigned callEffects(llvm::CallSite cs) {
+    if (cs.doesNotAccessMemory()) {
+      return None;
+    }
+    if (cs.onlyAccessesInaccessibleMemory()) {
+      return Inaccessible;
+    }
+    if (cs.onlyReadsMemory()) {
+      return ReadsGlobals;
+    }
+    return Unknown;
+  }
+
+  static bool hasCycle(llvm::Function *f) {
+    for (auto i = llvm::scc_begin(f); not i.isAtEnd(); ++i) {
+      if (i.hasLoop()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool inferSCC(std::vector<llvm::Function *> const &scc, bool recursive) {
+    llvm::SmallPtrSet<llvm::Function *, 4> component(scc.begin(), scc.end());
+    unsigned memory = None;
+    bool noUnwind = true;
+    bool returns = not recursive;
+
+    for (llvm::Function *f : scc) {
+      returns = returns and not hasCycle(f);
+      for (llvm::Instruction &ins : llvm::instructions(f)) {
+        if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+          if (not llvm::isa<llvm::AllocaInst>(load->getPointerOperand())) {
+            memory |= ReadsGlobals;
+          }
+        } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+          if (not llvm::isa<llvm::AllocaInst>(store->getPointerOperand())) {
+            memory |= WritesGlobals;
+          }
+        } else if (llvm::isa<llvm::CallInst>(ins)) {
+          llvm::CallSite cs(&ins);
+          llvm::Function *callee = cs.getCalledFunction();
+          if (callee != nullptr and component.count(callee)) {
+            continue;
+          }
+          memory |= callEffects(cs);
+          noUnwind = noUnwind and cs.doesNotThrow();
+          returns = returns and callee != nullptr and returns_.count(callee);
+        } else if (ins.mayReadOrWriteMemory()) {
+          memory |= Unknown;
+        }
+      }
+    }
+
+    bool changed = false;
+    for (llvm::Function *f : scc) {
+      if (memory == None and not f->hasFnAttribute(PURE)) {
+        f->addFnAttr(PURE);
+        changed = true;
+      }
+      bool added = false;
+      if (returns) {
+        returns_.insert(f);
+        if (memory == None) {
+          added = add(f, llvm::Attribute::ReadNone, readnone) or added;
+        } else if (memory == ReadsGlobals) {
+          added = add(f, llvm::Attribute::ReadOnly, readonly) or added;
+        }
+      }
+      if (memory == Inaccessible) {
+        added = add(f, llvm::Attribute::InaccessibleMemOnly, inaccessiblememonly) or added;
+      }
+      if (noUnwind) {
+        added = add(f, llvm::Attribute::NoUnwind, nounwind) or added;
+      }
+      if (not recursive) {
+        added = add(f, llvm::Attribute::NoRecurse, norecurse) or added;
+      }
+      if (added) {
+        addCallers(f);
+      }
+      changed = changed or added;
+    }
+    return changed;
+  }
+
+  void addCallers(llvm::Function *f) {
+    for (llvm::User *u : f->users()) {
+      if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(u)) {
+        if (callers_.insert(call->getFunction()).second) {
+          changed_.push_back(call->getFunction());
+        }
+      }
+    }
+  }
+
+  static bool add(llvm::Function *f, llvm::Attribute::AttrKind kind, llvm::Statistic &counter) {
+    if (f->hasFnAttribute(kind)) {
+      return false;
+    }
+    f->addFnAttr(kind);
+    ++counter;
+    return true;
+  }
+
+  llvm::SmallPtrSet<llvm::Function *, 16> returns_;
+  llvm::SmallPtrSet<llvm::Function *, 16> callers_;
+  std::vector<llvm::Function *> changed_;
+};
+
+}
+}
+#endif
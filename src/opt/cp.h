@@ -1,10 +1,12 @@
 #pragma once
 
-#include <map>
-#include <deque>
+#include <limits>
+#include <vector>
 
 #include "llvm.h"
 #include "mila.h"
+#include "worklist.h"
+#include "llvm/ADT/DepthFirstIterator.h"
 
 namespace mila {
 
@@ -136,54 +138,30 @@ class AValue {
   int value_;
 };
 
-class AState {
- public:
-
-  AState() = default;
-
-  AValue &operator[](llvm::Value *index) {
-    auto i = state_.find(index);
-    if (i == state_.end()) {
-      if (llvm::ConstantInt *ci = llvm::dyn_cast<llvm::ConstantInt>(index)) {
-        i = state_.insert(std::make_pair(index, ci->getZExtValue())).first;
-        // TODO something is missing here that would prevent the analysis from working properly. You will get extra points if you figure out what it is.
-      } else {
-        i = state_.insert(std::make_pair(index, AValue())).first;
-      }
-    }
-    return i->second;
-  }
-
-  bool mergeWith(AState const &other) {
-    bool changed = false;
+namespace cp {
 
-    // merge all variables from other with ourselves
-    for (auto i : other.state_) {
+/** What the rest of the module knows about a function: the values of its arguments and what the functions it calls
+    return. Without facts arguments and calls can be anything.
+  */
+class Facts {
+ public:
+  virtual ~Facts() = default;
 
-      // ignore bottom values, they can't change what we have
-      if (i.second.isBottom()) {
-        continue;
-      }
+  virtual AValue argument(llvm::Argument *arg) const = 0;
 
-      auto j = state_.find(i.first);
-      if (j == state_.end()) {
-        changed = true;
-        // no need to merge if we do not have the variable
-        state_.insert(i);
-      } else {
-        // merge otherwise
-        changed = j->second.mergeWith(i.second);
-      }
-    }
-    return changed;
-  }
-
- private:
-  std::map<llvm::Value *, AValue> state_;
+  virtual AValue result(llvm::Function *callee) const = 0;
 };
 
-namespace cp {
+/** Sparse conditional constant propagation.
 
+    Arguments and instructions are numbered densely and their abstract values live in a flat vector. Values only
+    move up the lattice and whenever one changes, its users are revisited along the SSA edges. Local variables, which
+    the compiler keeps in allocas, are tracked as memory slots. A block only keeps the slots whose value is known when
+    it is entered, any other slot may be anything, and a visit only records the slots the block stores to, so its cost
+    depends on the facts which reach the block and not on the number of variables. CFG edges are only marked
+    executable when the terminator of their source can take them, so blocks that are never reached are never
+    evaluated.
+  */
 class Analysis : public llvm::FunctionPass {
  public:
 
@@ -193,149 +171,351 @@ class Analysis : public llvm::FunctionPass {
       llvm::FunctionPass(ID) {
   }
 
+  static llvm::Statistic visits;
+  static llvm::Statistic pushes;
+  static llvm::Statistic duplicates;
+
   llvm::StringRef getPassName() const override {
     return "ConstantPropagationAnalysis";
   }
 
   bool runOnFunction(llvm::Function &f) override {
-    // cleanup from previous iteration
-    incommingStates_.clear();
-    q_.clear();
+    solve(f, nullptr);
+    // this is an analysis, it never changes the code
+    return false;
+  }
 
-    // get first basic block and initial state
-    auto bbList = f.getBasicBlockList().begin();
-    auto *first = llvm::dyn_cast<llvm::BasicBlock>(bbList);
-    incommingStates_[first] = initialState(f);
+  /** Analyzes the function, taking the values of arguments and calls from the facts if there are any. */
+  void solve(llvm::Function &f, Facts const *facts) {
+    // cleanup from previous iteration and number the function
+    number(f);
+    facts_ = facts;
+
+    for (llvm::Argument &arg : f.args()) {
+      values_[index_[&arg]] = facts == nullptr ? AValue(AValue::Type::Top) : facts->argument(&arg);
+    }
+
+    // local variables are uninitialized when the function starts, which the empty state of the entry says
+    llvm::BasicBlock *first = &f.getEntryBlock();
+    executable_[blockIndex_[first]] = true;
 
     // schedule the first basic block
-    q_.push_back(first);
+    q_.push(first);
+
+    while (!q_.empty() or !ssa_.empty()) {
+      // propagate changed values along the SSA edges first, this is cheap
+      while (!ssa_.empty()) {
+        llvm::Instruction *ins = ssa_.back();
+        ssa_.pop_back();
+        visitUsers(ins);
+      }
+      // then walk the blocks whose incomming state changed
+      if (!q_.empty()) {
+        visitBlock(q_.pop());
+      }
+    }
+    visits += q_.stats().visits;
+    pushes += q_.stats().pushes;
+    duplicates += q_.stats().duplicates;
+  }
 
-    // while there are basic blocks to analyze, analyze them
-    while (!q_.empty()) {
-      // get the basic block and incomming state copy
-      setBasicBlock(q_.front());
-      q_.pop_front();
+  /** Returns the abstract value of the given value. Integer constants are their own value, anything the analysis
+      does not know about may be anything.
+    */
+  AValue value(llvm::Value *v) const {
+    if (llvm::ConstantInt *ci = llvm::dyn_cast<llvm::ConstantInt>(v)) {
+      return AValue(static_cast<int>(ci->getZExtValue()));
+    }
+    auto i = index_.find(v);
+    if (i == index_.end()) {
+      return AValue::Type::Top;
+    }
+    return values_[i->second];
+  }
 
+  /** Returns true if the block can be reached by the analysis. */
+  bool isExecutable(llvm::BasicBlock *b) const {
+    auto i = blockIndex_.find(b);
+    return i != blockIndex_.end() and executable_[i->second];
+  }
 
-      // analyze the instructions
-      for (auto i = b_->getInstList().begin(), e = b_->end(); i != e; ++i) {
-        advanceInstruction(llvm::dyn_cast<llvm::Instruction>(i));
+  /** Returns true if the CFG edge from -> to can be taken. */
+  bool isExecutable(llvm::BasicBlock *from, llvm::BasicBlock *to) const {
+    auto i = blockIndex_.find(from);
+    if (i == blockIndex_.end()) {
+      return false;
+    }
+    llvm::TerminatorInst *t = from->getTerminator();
+    for (unsigned s = 0, e = t->getNumSuccessors(); s != e; ++s) {
+      if (t->getSuccessor(s) == to and edges_[edgeBase_[i->second] + s]) {
+        return true;
       }
+    }
+    return false;
+  }
 
-      // get the terminator instruction
-      llvm::TerminatorInst &tIns = static_cast<llvm::TerminatorInst &>(b_->back());
+  /** A local variable can be tracked if its address is only used to load from and store to it. */
+  static bool isTracked(llvm::AllocaInst *alloca) {
+    for (llvm::User *u : alloca->users()) {
+      if (llvm::isa<llvm::LoadInst>(u)) {
+        continue;
+      }
+      llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(u);
+      if (store == nullptr or store->getValueOperand() == alloca) {
+        return false;
+      }
+    }
+    return true;
+  }
 
-      // for all successors:
-      for (size_t i = 0, e = tIns.getNumSuccessors(); i < e; ++i) {
-        llvm::BasicBlock *succ = tIns.getSuccessor(i);
+ private:
 
-        // merge our state into its incomming and if there is change, schedule the block
-        if (incommingStates_[succ].mergeWith(currentState_)) {
-          q_.push_back(succ);
+  /** Known values of memory slots, any slot which is not in the state may be anything. */
+  typedef llvm::SmallDenseMap<unsigned, AValue, 4> State;
+
+  /** Assigns dense indices to arguments, instructions, blocks, CFG edges and trackable local variables. */
+  void number(llvm::Function &f) {
+    index_.clear();
+    blockIndex_.clear();
+    slotIndex_.clear();
+    values_.clear();
+    edgeBase_.clear();
+    edges_.clear();
+    q_.reset(f);
+    ssa_.clear();
+    slots_ = 0;
+
+    for (llvm::Argument &arg : f.args()) {
+      index_[&arg] = values_.size();
+      values_.push_back(AValue());
+    }
+    for (llvm::BasicBlock &b : f) {
+      blockIndex_[&b] = edgeBase_.size();
+      edgeBase_.push_back(edges_.size());
+      edges_.resize(edges_.size() + b.getTerminator()->getNumSuccessors(), false);
+      for (llvm::Instruction &ins : b) {
+        index_[&ins] = values_.size();
+        values_.push_back(AValue());
+        if (llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(&ins)) {
+          if (isTracked(alloca)) {
+            slotIndex_[alloca] = slots_++;
+          }
         }
       }
     }
+    executable_.assign(edgeBase_.size(), false);
+    incomming_.assign(edgeBase_.size(), State());
+  }
 
-    // this is an analysis, it never changes the code
-    return false;
+  /** Value of the slot in the block being visited, a slot which is not in the state may be anything. */
+  AValue slotValue(State const &in, unsigned slot) const {
+    auto i = stored_.find(slot);
+    if (i != stored_.end()) {
+      return i->second;
+    }
+    i = in.find(slot);
+    return i == in.end() ? AValue(AValue::Type::Top) : i->second;
   }
 
- private:
-  friend class Optimization;
+  void visitBlock(llvm::BasicBlock *b) {
+    // the incomming state is only read, the stores of the block are kept aside
+    State const &in = incomming_[blockIndex_[b]];
+    stored_.clear();
+
+    for (llvm::Instruction &ins : *b) {
+      if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+        auto slot = slotIndex_.find(load->getPointerOperand());
+        update(load, slot == slotIndex_.end() ? AValue(AValue::Type::Top) : slotValue(in, slot->second));
+      } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+        auto slot = slotIndex_.find(store->getPointerOperand());
+        if (slot != slotIndex_.end()) {
+          stored_[slot->second] = value(store->getValueOperand());
+        }
+      } else if (llvm::isa<llvm::TerminatorInst>(ins)) {
+        visitTerminator(b, in);
+      } else {
+        update(&ins, evaluate(&ins));
+      }
+    }
+  }
+
+  /** Marks the feasible outgoing edges as executable and merges the memory state into their targets.
+
+      A target reached for the first time takes the state as it is. Otherwise only the slots the target still knows
+      can change, slots it does not know may already be anything.
+    */
+  void visitTerminator(llvm::BasicBlock *b, State const &in) {
+    llvm::TerminatorInst *t = b->getTerminator();
+    unsigned base = edgeBase_[blockIndex_[b]];
+
+    for (unsigned i = 0, e = t->getNumSuccessors(); i != e; ++i) {
+      if (not isFeasible(t, i)) {
+        continue;
+      }
+      llvm::BasicBlock *succ = t->getSuccessor(i);
+      State &target = incomming_[blockIndex_[succ]];
+      bool changed = false;
+      if (not edges_[base + i]) {
+        edges_[base + i] = true;
+        changed = true;
+      }
+      if (not executable_[blockIndex_[succ]]) {
+        executable_[blockIndex_[succ]] = true;
+        target = in;
+        for (auto const &s : stored_) {
+          if (s.second.isTop()) {
+            target.erase(s.first);
+          } else {
+            target[s.first] = s.second;
+          }
+        }
+      } else {
+        llvm::SmallVector<unsigned, 8> unknown;
+        for (auto &s : target) {
+          changed = s.second.mergeWith(slotValue(in, s.first)) or changed;
+          if (s.second.isTop()) {
+            unknown.push_back(s.first);
+          }
+        }
+        for (unsigned s : unknown) {
+          target.erase(s);
+        }
+      }
+      // if there is change, schedule the block
+      if (changed) {
+        q_.push(succ);
+      }
+    }
+  }
 
-  AState initialState(llvm::Function &f) const {
-    AState result;
-    for (auto i = f.arg_begin(), e = f.arg_end(); i != e; ++i) {
-      result[i] = AValue::Type::Top;
+  bool isFeasible(llvm::TerminatorInst *t, unsigned successor) const {
+    if (llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(t)) {
+      if (br->isConditional()) {
+        AValue cond = value(br->getCondition());
+        if (cond.isBottom()) {
+          return false;
+        }
+        if (cond.isConst()) {
+          return (cond.value() != 0) == (successor == 0);
+        }
+        if (cond == AValue::Type::NonZero) {
+          return successor == 0;
+        }
+      }
     }
-    return result;
+    return true;
   }
 
-  void setBasicBlock(llvm::BasicBlock *block) {
-    b_ = block;
-    currentState_ = incommingStates_[b_];
+  /** Revisits users of an instruction whose value has changed. Memory operations and terminators depend on the
+      state of the block they are in, so their whole block is scheduled instead.
+    */
+  void visitUsers(llvm::Instruction *ins) {
+    for (llvm::User *u : ins->users()) {
+      llvm::Instruction *user = llvm::dyn_cast<llvm::Instruction>(u);
+      if (user == nullptr or not executable_[blockIndex_[user->getParent()]]) {
+        continue;
+      }
+      if (llvm::isa<llvm::LoadInst>(user) or llvm::isa<llvm::StoreInst>(user) or llvm::isa<llvm::TerminatorInst>(user)) {
+        q_.push(user->getParent());
+      } else {
+        update(user, evaluate(user));
+      }
+    }
+  }
+
+  void update(llvm::Instruction *ins, AValue const &v) {
+    if (values_[index_[ins]].mergeWith(v)) {
+      ssa_.push_back(ins);
+    }
   }
 
-  void advanceInstruction(llvm::Instruction *ins) {
-    if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(ins)) {
-      currentState_[ins] = currentState_[load->getOperand(0)];
-    } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
-      currentState_[store->getOperand(1)] = currentState_[store->getOperand(0)];
-    } else if (llvm::BinaryOperator *bop = llvm::dyn_cast<llvm::BinaryOperator>(ins)) {
-      AValue lhs = currentState_[bop->getOperand(0)];
-      AValue rhs = currentState_[bop->getOperand(1)];
-      assert(!lhs.isBottom());
-      assert(!rhs.isBottom());
-      if (lhs.isConst() && rhs.isConst()) {
+  /** Evaluates an instruction which does not touch memory. */
+  AValue evaluate(llvm::Instruction *ins) const {
+    if (llvm::BinaryOperator *bop = llvm::dyn_cast<llvm::BinaryOperator>(ins)) {
+      AValue lhs = value(bop->getOperand(0));
+      AValue rhs = value(bop->getOperand(1));
+      if (lhs.isBottom() or rhs.isBottom()) {
+        return AValue();
+      }
+      if (lhs.isConst() and rhs.isConst()) {
         switch (bop->getOpcode()) {
-          case llvm::Instruction::Add:currentState_[ins] = lhs.value() + rhs.value();
-            break;
-          case llvm::Instruction::Sub:currentState_[ins] = lhs.value() - rhs.value();
-            break;
-          case llvm::Instruction::Mul:currentState_[ins] = lhs.value() * rhs.value();
-            break;
-          case llvm::Instruction::SDiv:currentState_[ins] = lhs.value() / rhs.value();
-            break;
-          default:UNREACHABLE;
-            break;
+          case llvm::Instruction::Add:return lhs.value() + rhs.value();
+          case llvm::Instruction::Sub:return lhs.value() - rhs.value();
+          case llvm::Instruction::Mul:return lhs.value() * rhs.value();
+          case llvm::Instruction::SDiv:
+            if (rhs.isZero() or (rhs.value() == -1 and lhs.value() == std::numeric_limits<int>::min())) {
+              return AValue::Type::Top;
+            }
+            return lhs.value() / rhs.value();
+          default:break;
         }
-      } else {
-        currentState_[ins] = AValue::Type::Top;
       }
+      return AValue::Type::Top;
     } else if (llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(ins)) {
-      AValue lhs = currentState_[cmp->getOperand(0)];
-      AValue rhs = currentState_[cmp->getOperand(1)];
-      assert(!lhs.isBottom());
-      assert(!rhs.isBottom());
-      if (lhs.isConst() && rhs.isConst()) {
+      AValue lhs = value(cmp->getOperand(0));
+      AValue rhs = value(cmp->getOperand(1));
+      if (lhs.isBottom() or rhs.isBottom()) {
+        return AValue();
+      }
+      if (lhs.isConst() and rhs.isConst()) {
         switch (cmp->getSignedPredicate()) {
-          case llvm::ICmpInst::ICMP_EQ:currentState_[ins] = lhs.value() == rhs.value();
-            break;
-          case llvm::ICmpInst::ICMP_NE:currentState_[ins] = lhs.value() != rhs.value();
-            break;
-          case llvm::ICmpInst::ICMP_SLT:currentState_[ins] = lhs.value() < rhs.value();
-            break;
-          case llvm::ICmpInst::ICMP_SGT:currentState_[ins] = lhs.value() > rhs.value();
-            break;
-          case llvm::ICmpInst::ICMP_SLE:currentState_[ins] = lhs.value() <= rhs.value();
-            break;
-          case llvm::ICmpInst::ICMP_SGE:currentState_[ins] = lhs.value() >= rhs.value();
-            break;
-          default:UNREACHABLE;
-            break;
+          case llvm::ICmpInst::ICMP_EQ:return lhs.value() == rhs.value();
+          case llvm::ICmpInst::ICMP_NE:return lhs.value() != rhs.value();
+          case llvm::ICmpInst::ICMP_SLT:return lhs.value() < rhs.value();
+          case llvm::ICmpInst::ICMP_SGT:return lhs.value() > rhs.value();
+          case llvm::ICmpInst::ICMP_SLE:return lhs.value() <= rhs.value();
+          case llvm::ICmpInst::ICMP_SGE:return lhs.value() >= rhs.value();
+          default:break;
         }
-      } else {
-        currentState_[ins] = AValue::Type::Top;
       }
-      // TODO I am homework - what other instructions do we need to care about? Do we have to do something with those we do not care about wrt cp analysis?
-      // phi node
-      // zext
-      // unary
-      // vsechny ostatni instrukce
+      return AValue::Type::Top;
     } else if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(ins)) {
-      AValue result = currentState_[phi->getOperand(0)];
-      for (size_t i = 1, e = phi->getNumOperands(); i != e; ++i) {
-        result.mergeWith(currentState_[phi->getOperand(i)]);
+      // only values flowing over executable edges matter
+      AValue result;
+      for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e; ++i) {
+        if (isExecutable(phi->getIncomingBlock(i), phi->getParent())) {
+          result.mergeWith(value(phi->getIncomingValue(i)));
+        }
       }
-      currentState_[ins] = result;
+      return result;
     } else if (llvm::ZExtInst *zext = llvm::dyn_cast<llvm::ZExtInst>(ins)) {
-      currentState_[ins] = currentState_[zext->getOperand(0)];
+      return value(zext->getOperand(0));
+    } else if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(ins)) {
+      if (facts_ != nullptr and call->getCalledFunction() != nullptr) {
+        return facts_->result(call->getCalledFunction());
+      }
     }
+    // calls, allocas and everything else can be anything
+    return AValue::Type::Top;
   }
 
-  llvm::BasicBlock *b_;
+  llvm::DenseMap<llvm::Value *, unsigned> index_;
+  llvm::DenseMap<llvm::BasicBlock *, unsigned> blockIndex_;
+  llvm::DenseMap<llvm::Value *, unsigned> slotIndex_;
+  unsigned slots_ = 0;
+
+  std::vector<AValue> values_;
+  std::vector<unsigned> edgeBase_;
+  std::vector<bool> edges_;
+  std::vector<bool> executable_;
+
+  std::vector<State> incomming_;
+  State stored_;
 
-  AState currentState_;
-  std::map<llvm::BasicBlock *, AState> incommingStates_;
-  std::deque<llvm::BasicBlock *> q_;
+  Worklist q_;
+  std::vector<llvm::Instruction *> ssa_;
+  Facts const *facts_ = nullptr;
 };
 
 class Optimization : public llvm::FunctionPass {
  public:
-    llvm::Type *t_int = llvm::IntegerType::get(mainContext, 32);
 
   static char ID;
 
+  static llvm::Statistic constants;
+  static llvm::Statistic branches;
+  static llvm::Statistic unreachable;
+
   Optimization() :
       llvm::FunctionPass(ID) {
   }
@@ -351,21 +531,92 @@ class Optimization : public llvm::FunctionPass {
   bool runOnFunction(llvm::Function &f) override {
     bool changed = false;
     Analysis &a = getAnalysis<Analysis>();
+    llvm::SmallVector<llvm::Instruction *, 32> folded;
 
+    // replace instructions with constant values
     for (llvm::BasicBlock &b : f) {
-      a.setBasicBlock(&b);
-
+      if (not a.isExecutable(&b)) {
+        continue;
+      }
       for (llvm::Instruction &ins : b) {
-        a.advanceInstruction(&ins);
-
-        AValue val = a.currentState_[&ins];
-        if (val.isConst()) {
+        if (ins.getType()->isVoidTy()) {
+          continue;
+        }
+        AValue val = a.value(&ins);
+        // calls kept for their side effects only change something while their result is used
+        if (val.isConst() and (not ins.use_empty() or not ins.mayHaveSideEffects())) {
           ins.replaceAllUsesWith(llvm::ConstantInt::get(ins.getType(), val.value(), false));
+          if (not ins.mayHaveSideEffects()) {
+            folded.push_back(&ins);
+          }
+          ++constants;
           changed = true;
         }
       }
     }
-    return changed;
+
+    // rewrite branches whose direction is known
+    for (llvm::BasicBlock &b : f) {
+      llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(b.getTerminator());
+      if (br == nullptr or not br->isConditional() or not a.isExecutable(&b)) {
+        continue;
+      }
+      AValue cond = a.value(br->getCondition());
+      if (cond.isConst() or cond == AValue::Type::NonZero) {
+        foldBranch(&b, not cond.isZero());
+        ++branches;
+        changed = true;
+      }
+    }
+
+    for (llvm::Instruction *ins : folded) {
+      ins->eraseFromParent();
+    }
+
+    return removeUnreachableBlocks(f) or changed;
+  }
+
+  /** Replaces the conditional branch terminating the block with an unconditional one to the taken successor and
+      removes the block from the phi nodes of the successor which is no longer taken.
+    */
+  static void foldBranch(llvm::BasicBlock *b, bool taken) {
+    llvm::BranchInst *br = llvm::cast<llvm::BranchInst>(b->getTerminator());
+    llvm::BasicBlock *target = br->getSuccessor(taken ? 0 : 1);
+    llvm::BasicBlock *dropped = br->getSuccessor(taken ? 1 : 0);
+    if (dropped != target) {
+      dropped->removePredecessor(b, true);
+    }
+    llvm::BranchInst::Create(target, br);
+    br->eraseFromParent();
+  }
+
+  /** Deletes blocks which can no longer be reached from the entry. */
+  static bool removeUnreachableBlocks(llvm::Function &f) {
+    llvm::SmallPtrSet<llvm::BasicBlock *, 32> reachable;
+    for (llvm::BasicBlock *b : llvm::depth_first(&f.getEntryBlock())) {
+      reachable.insert(b);
+    }
+
+    llvm::SmallVector<llvm::BasicBlock *, 32> dead;
+    for (llvm::BasicBlock &b : f) {
+      if (not reachable.count(&b)) {
+        dead.push_back(&b);
+      }
+    }
+
+    for (llvm::BasicBlock *b : dead) {
+      for (llvm::BasicBlock *succ : llvm::successors(b)) {
+        if (reachable.count(succ)) {
+          succ->removePredecessor(b, true);
+        }
+      }
+      b->dropAllReferences();
+    }
+    for (llvm::BasicBlock *b : dead) {
+      b->eraseFromParent();
+    }
+    unreachable += dead.size();
+    return not dead.empty();
   }
 
 };
@@ -373,4 +624,3 @@ class Optimization : public llvm::FunctionPass {
 }
 
 }
-
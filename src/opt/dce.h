@@ -12,6 +12,8 @@ class Optimization : public llvm::FunctionPass {
  public:
   static char ID;
 
+  static llvm::Statistic removed;
+
   Optimization() :
       llvm::FunctionPass(ID) {
   }
@@ -55,6 +57,7 @@ class Optimization : public llvm::FunctionPass {
     for (llvm::Instruction *&i: list) {
       i->eraseFromParent();
     }
+    removed += list.size();
 
     return !list.empty();
   }
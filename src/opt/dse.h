@@ -13,6 +13,8 @@ namespace mila {
         public:
             static char ID;
 
+            static llvm::Statistic removed;
+
             Optimization() :
                     llvm::FunctionPass(ID) {
             }
@@ -55,6 +57,7 @@ namespace mila {
                 for (llvm::Instruction *&i: toRemove) {
                     i->eraseFromParent();
                 }
+                removed += toRemove.size();
 
 
                 return !toRemove.empty();
@@ -0,0 +1,278 @@
+#ifndef OPT_GLOBALS_H
+#define OPT_GLOBALS_H
+
+#include <map>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/CFG.h"
+
+namespace mila {
+
+namespace globals {
+
+/** Promotes global variables to local shadows which mem2reg then turns into registers.
+
+    Every global the function only loads and stores gets a local variable, loaded from the global on entry, and all
+    accesses in the function go to the local instead. The global is only brought up to date where someone else may
+    look at it: before calls to functions which may, transitively, read or write it and before returning, and only if
+    the local may have been stored to since the global was last synchronized. After calls which may write the global it
+    is reloaded. The runtime functions touch only inaccessible memory and need neither, so loops whose only calls are
+    read and write keep the globals in registers.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic promoted;
+  static llvm::Statistic spills;
+  static llvm::Statistic reloads;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "GlobalPromotion";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.setPreservesCFG();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    effects_.clear();
+    globals_.clear();
+    shadows_.clear();
+    initial_.clear();
+    for (llvm::GlobalVariable &g : f.getParent()->globals()) {
+      if (isPromotable(&g, &f)) {
+        globals_.push_back(&g);
+      }
+    }
+    if (globals_.empty()) {
+      return false;
+    }
+
+    // the effects of recursive calls come from the accesses of this function, which are about to go to the shadows
+    for (llvm::Instruction &ins : llvm::instructions(f)) {
+      if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&ins)) {
+        effects(call);
+      }
+    }
+
+    // shadows are created at the top of the entry block, mem2reg only looks there
+    llvm::IRBuilder<> b(&f.getEntryBlock(), f.getEntryBlock().begin());
+    for (llvm::GlobalVariable *g : globals_) {
+      std::vector<llvm::Use *> accesses;
+      for (llvm::Use &u : g->uses()) {
+        if (llvm::cast<llvm::Instruction>(u.getUser())->getFunction() == &f) {
+          accesses.push_back(&u);
+        }
+      }
+      llvm::AllocaInst *shadow = b.CreateAlloca(g->getValueType(), nullptr, g->getName());
+      initial_.insert(b.CreateStore(b.CreateLoad(g), shadow));
+      for (llvm::Use *u : accesses) {
+        u->set(shadow);
+      }
+      shadows_.push_back(shadow);
+      ++promoted;
+    }
+
+    std::map<llvm::BasicBlock *, llvm::BitVector> dirtyIn = dirtiness(f);
+    for (llvm::BasicBlock &block : f) {
+      synchronize(&block, dirtyIn[&block]);
+    }
+    return true;
+  }
+
+ private:
+
+  /** Globals a call may read and write. */
+  class Effects {
+   public:
+    llvm::SmallPtrSet<llvm::GlobalVariable *, 8> reads;
+    llvm::SmallPtrSet<llvm::GlobalVariable *, 8> writes;
+    bool unknown = false;
+
+    bool touches(llvm::GlobalVariable *g) const {
+      return unknown or reads.count(g) or writes.count(g);
+    }
+
+    bool mayWrite(llvm::GlobalVariable *g) const {
+      return unknown or writes.count(g);
+    }
+  };
+
+  /** Mila has no pointers, so the address of a global is only ever loaded and stored. */
+  static bool isPromotable(llvm::GlobalVariable *g, llvm::Function *f) {
+    bool used = false;
+    for (llvm::User *u : g->users()) {
+      llvm::Instruction *ins = llvm::dyn_cast<llvm::Instruction>(u);
+      if (ins == nullptr) {
+        return false;
+      }
+      if (ins->getFunction() != f) {
+        continue;
+      }
+      if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(ins)) {
+        if (load->isVolatile()) {
+          return false;
+        }
+      } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
+        if (store->isVolatile() or store->getValueOperand() == g) {
+          return false;
+        }
+      } else {
+        return false;
+      }
+      used = true;
+    }
+    return used;
+  }
+
+  /** Effects of the callee and everything it calls. */
+  Effects const &effects(llvm::CallInst *call) {
+    llvm::Function *callee = call->getCalledFunction();
+    auto i = effects_.find(callee);
+    if (i != effects_.end()) {
+      return i->second;
+    }
+    Effects &result = effects_[callee];
+    if (callee == nullptr) {
+      result.unknown = true;
+      return result;
+    }
+    llvm::SmallPtrSet<llvm::Function *, 16> visited;
+    llvm::SmallVector<llvm::Function *, 16> q;
+    q.push_back(callee);
+    while (not q.empty()) {
+      llvm::Function *fn = q.pop_back_val();
+      if (not visited.insert(fn).second) {
+        continue;
+      }
+      if (fn->isDeclaration()) {
+        if (not (fn->doesNotAccessMemory() or fn->onlyAccessesInaccessibleMemory()
+                 or fn->onlyAccessesInaccessibleMemOrArgMem())) {
+          result.unknown = true;
+        }
+        continue;
+      }
+      for (llvm::Instruction &ins : llvm::instructions(fn)) {
+        if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+          if (llvm::GlobalVariable *g = llvm::dyn_cast<llvm::GlobalVariable>(load->getPointerOperand())) {
+            result.reads.insert(g);
+          }
+        } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+          if (llvm::GlobalVariable *g = llvm::dyn_cast<llvm::GlobalVariable>(store->getPointerOperand())) {
+            result.writes.insert(g);
+          }
+        } else if (llvm::CallInst *inner = llvm::dyn_cast<llvm::CallInst>(&ins)) {
+          if (inner->getCalledFunction() == nullptr) {
+            result.unknown = true;
+          } else {
+            q.push_back(inner->getCalledFunction());
+          }
+        }
+      }
+    }
+    return result;
+  }
+
+  /** Updates the globals whose shadows may differ from them after the instruction. */
+  void transfer(llvm::Instruction *ins, llvm::BitVector &dirty) {
+    if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
+      if (initial_.count(store)) {
+        return;
+      }
+      for (unsigned i = 0, e = shadows_.size(); i != e; ++i) {
+        if (store->getPointerOperand() == shadows_[i]) {
+          dirty.set(i);
+        }
+      }
+    } else if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(ins)) {
+      // the global is spilled or reloaded around any call which looks at it
+      Effects const &e = effects(call);
+      for (unsigned i = 0, n = globals_.size(); i != n; ++i) {
+        if (e.touches(globals_[i])) {
+          dirty.reset(i);
+        }
+      }
+    }
+  }
+
+  /** Forward may analysis of the dirty shadows at the start of every block. */
+  std::map<llvm::BasicBlock *, llvm::BitVector> dirtiness(llvm::Function &f) {
+    std::map<llvm::BasicBlock *, llvm::BitVector> in;
+    std::map<llvm::BasicBlock *, llvm::BitVector> out;
+    for (llvm::BasicBlock &b : f) {
+      in[&b] = llvm::BitVector(globals_.size());
+      out[&b] = llvm::BitVector(globals_.size());
+    }
+    llvm::SmallSetVector<llvm::BasicBlock *, 16> q;
+    for (llvm::BasicBlock &b : f) {
+      q.insert(&b);
+    }
+    while (not q.empty()) {
+      llvm::BasicBlock *b = q.pop_back_val();
+      llvm::BitVector dirty(globals_.size());
+      for (llvm::BasicBlock *pred : llvm::predecessors(b)) {
+        dirty |= out[pred];
+      }
+      in[b] = dirty;
+      for (llvm::Instruction &ins : *b) {
+        transfer(&ins, dirty);
+      }
+      if (dirty != out[b]) {
+        out[b] = dirty;
+        for (llvm::BasicBlock *succ : llvm::successors(b)) {
+          q.insert(succ);
+        }
+      }
+    }
+    return in;
+  }
+
+  void synchronize(llvm::BasicBlock *block, llvm::BitVector dirty) {
+    for (auto i = block->begin(), e = block->end(); i != e;) {
+      llvm::Instruction *ins = &*i++;
+      if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(ins)) {
+        Effects const &effects = this->effects(call);
+        for (unsigned g = 0, n = globals_.size(); g != n; ++g) {
+          if (dirty[g] and effects.touches(globals_[g])) {
+            spill(g, call);
+          }
+          if (effects.mayWrite(globals_[g])) {
+            llvm::IRBuilder<> b(block, i);
+            b.CreateStore(b.CreateLoad(globals_[g]), shadows_[g]);
+            ++reloads;
+          }
+        }
+      } else if (llvm::isa<llvm::ReturnInst>(ins)) {
+        for (unsigned g : dirty.set_bits()) {
+          spill(g, ins);
+        }
+      }
+      transfer(ins, dirty);
+    }
+  }
+
+  void spill(unsigned g, llvm::Instruction *before) {
+    llvm::IRBuilder<> b(before);
+    b.CreateStore(b.CreateLoad(shadows_[g]), globals_[g]);
+    ++spills;
+  }
+
+  std::map<llvm::Function *, Effects> effects_;
+  std::vector<llvm::GlobalVariable *> globals_;
+  std::vector<llvm::AllocaInst *> shadows_;
+  /** Stores loading the shadows from the globals on entry, which leave them clean. */
+  llvm::SmallPtrSet<llvm::StoreInst *, 8> initial_;
+};
+
+}
+}
+#endif
@@ -0,0 +1,190 @@
+#ifndef OPT_GVN_H
+#define OPT_GVN_H
+
+#include <iterator>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace gvn {
+
+/** Dominator scoped value numbering.
+
+    The dominator tree is walked keeping a table of the expressions computed by the dominating code, binary operators,
+    comparisons and zero extensions are keyed by their opcode, type and operands. An instruction already in the table
+    is replaced by the dominating one. Loads are numbered the same way by the variable they read, with the last value
+    stored or loaded being available until a call may clobber it. Local variables whose address never escapes survive
+    calls. Memory is only trusted along single predecessor edges, a join may have been reached through a store.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic instructionsBefore;
+  static llvm::Statistic instructionsAfter;
+  static llvm::Statistic expressions;
+  static llvm::Statistic loads;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "GlobalValueNumbering";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::DominatorTreeWrapperPass>();
+    au.setPreservesCFG();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    instructionsBefore += std::distance(llvm::inst_begin(f), llvm::inst_end(f));
+    llvm::DominatorTree &dt = getAnalysis<llvm::DominatorTreeWrapperPass>().getDomTree();
+    expressions_.clear();
+    memory_.clear();
+    generation_ = 0;
+    dead_.clear();
+    visit(dt.getRootNode());
+    for (llvm::Instruction *ins : dead_) {
+      ins->eraseFromParent();
+    }
+    instructionsAfter += std::distance(llvm::inst_begin(f), llvm::inst_end(f));
+    return not dead_.empty();
+  }
+
+ private:
+
+  /** Opcode or predicate, result type and up to two operands. */
+  typedef std::tuple<unsigned, llvm::Type *, llvm::Value *, llvm::Value *> Expression;
+
+  /** Value of a variable and the generation of memory it was seen in. */
+  typedef std::pair<llvm::Value *, unsigned> Available;
+
+  static bool key(llvm::Instruction *ins, Expression &e) {
+    if (llvm::BinaryOperator *op = llvm::dyn_cast<llvm::BinaryOperator>(ins)) {
+      llvm::Value *lhs = op->getOperand(0);
+      llvm::Value *rhs = op->getOperand(1);
+      if (op->isCommutative() and std::less<llvm::Value *>()(rhs, lhs)) {
+        std::swap(lhs, rhs);
+      }
+      e = Expression(op->getOpcode(), op->getType(), lhs, rhs);
+      return true;
+    }
+    if (llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(ins)) {
+      llvm::Value *lhs = cmp->getOperand(0);
+      llvm::Value *rhs = cmp->getOperand(1);
+      llvm::CmpInst::Predicate p = cmp->getPredicate();
+      if (std::less<llvm::Value *>()(rhs, lhs)) {
+        std::swap(lhs, rhs);
+        p = llvm::CmpInst::getSwappedPredicate(p);
+      }
+      // predicates do not overlap with the opcodes
+      e = Expression(llvm::Instruction::ICmp * 256 + p, cmp->getType(), lhs, rhs);
+      return true;
+    }
+    if (llvm::ZExtInst *zext = llvm::dyn_cast<llvm::ZExtInst>(ins)) {
+      e = Expression(zext->getOpcode(), zext->getType(), zext->getOperand(0), nullptr);
+      return true;
+    }
+    return false;
+  }
+
+  /** Variables which cannot change without a store to them: globals until the next call, locals always. */
+  static bool isVariable(llvm::Value *ptr) {
+    if (llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(ptr)) {
+      return cp::Analysis::isTracked(alloca);
+    }
+    return llvm::isa<llvm::GlobalVariable>(ptr);
+  }
+
+  void visit(llvm::DomTreeNode *node) {
+    llvm::BasicBlock *b = node->getBlock();
+    if (b->getSinglePredecessor() == nullptr) {
+      ++generation_;
+    }
+    std::vector<Expression> scope;
+    std::vector<std::pair<llvm::Value *, Available>> shadowed;
+
+    auto remember = [&](llvm::Value *ptr, llvm::Value *value) {
+      auto i = memory_.find(ptr);
+      shadowed.push_back(std::make_pair(ptr, i == memory_.end() ? Available(nullptr, 0) : i->second));
+      memory_[ptr] = Available(value, generation_);
+    };
+
+    for (llvm::Instruction &ins : *b) {
+      Expression e;
+      if (key(&ins, e)) {
+        auto i = expressions_.find(e);
+        if (i != expressions_.end()) {
+          i->second->andIRFlags(&ins);
+          ins.replaceAllUsesWith(i->second);
+          dead_.push_back(&ins);
+          ++expressions;
+        } else {
+          expressions_[e] = &ins;
+          scope.push_back(e);
+        }
+      } else if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+        llvm::Value *ptr = load->getPointerOperand();
+        if (load->isVolatile() or not isVariable(ptr)) {
+          continue;
+        }
+        auto i = memory_.find(ptr);
+        if (i != memory_.end() and i->second.first != nullptr and i->second.second == generation_) {
+          load->replaceAllUsesWith(i->second.first);
+          dead_.push_back(load);
+          ++loads;
+        } else {
+          remember(ptr, load);
+        }
+      } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+        llvm::Value *ptr = store->getPointerOperand();
+        if (not store->isVolatile() and isVariable(ptr)) {
+          remember(ptr, store->getValueOperand());
+        } else {
+          ++generation_;
+        }
+      } else if (ins.mayWriteToMemory()) {
+        // calls may change any global, the locals still valid carry over to the next generation
+        unsigned before = generation_++;
+        for (auto &i : memory_) {
+          if (llvm::isa<llvm::AllocaInst>(i.first) and i.second.first != nullptr and i.second.second == before) {
+            remember(i.first, i.second.first);
+          }
+        }
+      }
+    }
+
+    // the children start from the memory as it is at the end of the block
+    unsigned end = generation_;
+    for (llvm::DomTreeNode *child : *node) {
+      generation_ = end;
+      visit(child);
+    }
+
+    for (Expression const &e : scope) {
+      expressions_.erase(e);
+    }
+    for (auto i = shadowed.rbegin(), e = shadowed.rend(); i != e; ++i) {
+      memory_[i->first] = i->second;
+    }
+  }
+
+  std::map<Expression, llvm::Instruction *> expressions_;
+  std::map<llvm::Value *, Available> memory_;
+  unsigned generation_ = 0;
+  std::vector<llvm::Instruction *> dead_;
+};
+
+}
+}
+#endif
@@ -0,0 +1,126 @@
+#ifndef OPT_INDVARS_H
+#define OPT_INDVARS_H
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+
+namespace mila {
+
+namespace indvars {
+
+/** Induction variable simplification.
+
+    Values leaving a loop are replaced by closed form expressions scalar evolution computes for them at the exit,
+    which covers polynomial recurrences such as sums of a counter. A loop whose results are all computed this way and
+    which has no side effects is then deleted, provided scalar evolution can also prove it terminates. Deleted loops
+    are reported as optimization remarks.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic exitValues;
+  static llvm::Statistic deleted;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "InductionVariableSimplification";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::LoopInfoWrapperPass>();
+    au.addRequired<llvm::ScalarEvolutionWrapperPass>();
+    au.addRequired<llvm::DominatorTreeWrapperPass>();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    llvm::LoopInfo &li = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+    llvm::ScalarEvolution &se = getAnalysis<llvm::ScalarEvolutionWrapperPass>().getSE();
+    llvm::DominatorTree &dt = getAnalysis<llvm::DominatorTreeWrapperPass>().getDomTree();
+    llvm::OptimizationRemarkEmitter ore(&f);
+    bool changed = false;
+    // inner loops first, an outer loop can only be deleted once its inner loops are
+    llvm::SmallVector<llvm::Loop *, 4> loops = li.getLoopsInPreorder();
+    for (auto i = loops.rbegin(), e = loops.rend(); i != e; ++i) {
+      changed = runOnLoop(*i, li, se, dt, ore) or changed;
+    }
+    return changed;
+  }
+
+ private:
+
+  bool runOnLoop(llvm::Loop *l, llvm::LoopInfo &li, llvm::ScalarEvolution &se, llvm::DominatorTree &dt,
+                 llvm::OptimizationRemarkEmitter &ore) {
+    llvm::BasicBlock *exit = l->getUniqueExitBlock();
+    if (not l->isLoopSimplifyForm() or exit == nullptr or l->getExitingBlock() == nullptr) {
+      return false;
+    }
+    bool changed = llvm::formLCSSARecursively(*l, dt, &li, &se);
+    changed = replaceExitValues(l, exit, se) or changed;
+    if (isDead(l, exit, se)) {
+      ore.emit(llvm::OptimizationRemark(REMARKS, "Deleted", l->getStartLoc(), l->getHeader())
+                   << "deleted loop whose results are computed in closed form");
+      llvm::deleteDeadLoop(l, &dt, &se, &li);
+      ++deleted;
+      changed = true;
+    }
+    return changed;
+  }
+
+  /** In LCSSA form every value used after the loop goes through a phi in the exit block. */
+  static bool replaceExitValues(llvm::Loop *l, llvm::BasicBlock *exit, llvm::ScalarEvolution &se) {
+    llvm::SCEVExpander expander(se, exit->getModule()->getDataLayout(), "indvars");
+    llvm::Instruction *ip = &*exit->getFirstInsertionPt();
+    bool changed = false;
+    for (auto i = exit->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i);) {
+      ++i;
+      if (not se.isSCEVable(phi->getType())) {
+        continue;
+      }
+      const llvm::SCEV *value = se.getSCEVAtScope(phi->getIncomingValue(0), l->getParentLoop());
+      if (llvm::isa<llvm::SCEVCouldNotCompute>(value) or not se.isLoopInvariant(value, l)
+          or expander.isHighCostExpansion(value, l, ip)) {
+        continue;
+      }
+      llvm::Value *closed = expander.expandCodeFor(value, phi->getType(), ip);
+      // scalar evolution caches the phi, it must forget it before it goes away
+      se.forgetValue(phi);
+      phi->replaceAllUsesWith(closed);
+      phi->eraseFromParent();
+      ++exitValues;
+      changed = true;
+    }
+    return changed;
+  }
+
+  /** A loop is dead if it terminates, nothing it computes is used afterwards and it has no side effects. */
+  static bool isDead(llvm::Loop *l, llvm::BasicBlock *exit, llvm::ScalarEvolution &se) {
+    if (llvm::isa<llvm::PHINode>(exit->front())
+        or llvm::isa<llvm::SCEVCouldNotCompute>(se.getBackedgeTakenCount(l))) {
+      return false;
+    }
+    for (llvm::BasicBlock *b : l->blocks()) {
+      for (llvm::Instruction &ins : *b) {
+        if (ins.mayHaveSideEffects()) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static constexpr const char *REMARKS = "mila-indvars";
+};
+
+}
+}
+#endif
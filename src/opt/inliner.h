@@ -0,0 +1,194 @@
+#ifndef OPT_INLINER_H
+#define OPT_INLINER_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+namespace mila {
+
+namespace inliner {
+
+/** Inlines calls to user functions.
+
+    The strongly connected components of the call graph are visited bottom-up, so that callees have already been
+    inlined into when their callers are processed. Calls within a component are recursive and never inlined, neither
+    are calls to functions which call themselves. For the other calls the size of the callee is weighed against a
+    threshold which grows for calls in loops, for constant arguments and for callees called from a single place, and
+    the caller may not grow beyond a budget. When the code is annotated with a profile, calls which never ran are not
+    inlined and the threshold grows for hot calls.
+  */
+class Optimization : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  static llvm::Statistic callSites;
+  static llvm::Statistic inlined;
+
+  /** Base threshold on the size of the callee. */
+  static constexpr int INLINE_THRESHOLD = 25;
+
+  /** Bonus for calls inside loops, which run repeatedly. */
+  static constexpr int LOOP_BONUS = 25;
+
+  /** Bonus for each constant argument, which cp can then propagate into the body. */
+  static constexpr int CONSTANT_ARGUMENT_BONUS = 5;
+
+  /** Bonus for the only call to a function. */
+  static constexpr int SINGLE_CALL_BONUS = 25;
+
+  /** Executions after which a call counts as hot. */
+  static constexpr uint64_t HOT_CALL_COUNT = 1000;
+
+  /** Bonus for hot calls. */
+  static constexpr int HOT_CALL_BONUS = 50;
+
+  /** Size above which no more code is inlined into a function. */
+  static constexpr unsigned CALLER_BUDGET = 1000;
+
+  Optimization() :
+      llvm::ModulePass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "FunctionInlining";
+  }
+
+  /** Functions which had calls inlined into them in the last run. */
+  std::vector<llvm::Function *> const &changed() const {
+    return changed_;
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    changed_.clear();
+    countCalls(m);
+
+    // callees before callers
+    std::vector<std::vector<llvm::Function *>> sccs;
+    llvm::CallGraph cg(m);
+    for (auto i = llvm::scc_begin(&cg); not i.isAtEnd(); ++i) {
+      sccs.emplace_back();
+      for (llvm::CallGraphNode *node : *i) {
+        if (node->getFunction() != nullptr and not node->getFunction()->isDeclaration()) {
+          sccs.back().push_back(node->getFunction());
+        }
+      }
+    }
+
+    for (std::vector<llvm::Function *> const &scc : sccs) {
+      llvm::SmallPtrSet<llvm::Function *, 4> component(scc.begin(), scc.end());
+      for (llvm::Function *caller : scc) {
+        if (inlineCalls(caller, component)) {
+          changed_.push_back(caller);
+        }
+      }
+    }
+    return not changed_.empty();
+  }
+
+ private:
+
+  static unsigned size(llvm::Function *f) {
+    unsigned result = 0;
+    for (llvm::Instruction &ins : llvm::instructions(f)) {
+      if (not llvm::isa<llvm::AllocaInst>(ins)) {
+        ++result;
+      }
+    }
+    return result;
+  }
+
+  void countCalls(llvm::Module &m) {
+    calls_.clear();
+    for (llvm::Function &f : m) {
+      for (llvm::Instruction &ins : llvm::instructions(f)) {
+        if (llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&ins)) {
+          if (call->getCalledFunction() != nullptr) {
+            ++calls_[call->getCalledFunction()];
+          }
+        }
+      }
+    }
+  }
+
+  static bool isRecursive(llvm::Function *f) {
+    for (llvm::User *u : f->users()) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(u);
+      if (call != nullptr and call->getFunction() == f) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool shouldInline(llvm::CallInst *call, llvm::Function *callee, llvm::LoopInfo &li) {
+    int threshold = INLINE_THRESHOLD;
+    if (li.getLoopFor(call->getParent()) != nullptr) {
+      threshold += LOOP_BONUS;
+    }
+    for (llvm::Value *arg : call->arg_operands()) {
+      if (llvm::isa<llvm::Constant>(arg)) {
+        threshold += CONSTANT_ARGUMENT_BONUS;
+      }
+    }
+    if (calls_[callee] == 1) {
+      threshold += SINGLE_CALL_BONUS;
+    }
+    if (llvm::MDNode *md = call->getMetadata("mila.count")) {
+      uint64_t count = llvm::mdconst::extract<llvm::ConstantInt>(md->getOperand(0))->getZExtValue();
+      if (count == 0) {
+        return false;
+      }
+      threshold += count >= HOT_CALL_COUNT ? HOT_CALL_BONUS : 0;
+    }
+    return static_cast<int>(size(callee)) <= threshold;
+  }
+
+  bool inlineCalls(llvm::Function *caller, llvm::SmallPtrSet<llvm::Function *, 4> const &component) {
+    llvm::DominatorTree dt(*caller);
+    llvm::LoopInfo li(dt);
+    llvm::SmallVector<llvm::CallInst *, 8> calls;
+    for (llvm::Instruction &ins : llvm::instructions(caller)) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&ins);
+      if (call == nullptr) {
+        continue;
+      }
+      llvm::Function *callee = call->getCalledFunction();
+      if (callee == nullptr or callee->isDeclaration() or component.count(callee) or isRecursive(callee)) {
+        continue;
+      }
+      ++callSites;
+      if (shouldInline(call, callee, li)) {
+        calls.push_back(call);
+      }
+    }
+
+    // the loop info is stale once the first call is inlined, but the decisions are already made
+    bool changed = false;
+    for (llvm::CallInst *call : calls) {
+      if (size(caller) > CALLER_BUDGET) {
+        break;
+      }
+      llvm::InlineFunctionInfo info;
+      if (llvm::InlineFunction(llvm::CallSite(call), info)) {
+        ++inlined;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  llvm::DenseMap<llvm::Function *, unsigned> calls_;
+  std::vector<llvm::Function *> changed_;
+};
+
+}
+}
+#endif
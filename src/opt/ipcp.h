@@ -0,0 +1,174 @@
+#ifndef OPT_IPCP_H
+#define OPT_IPCP_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SetVector.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace ipcp {
+
+/** Interprocedural constant propagation.
+
+    The cp solver is run on every function with the arguments and the results of calls taken from module wide facts.
+    The arguments of a function whose address does not escape are the merge of the values passed by its call sites in
+    executable code, the result of a function is the merge of the values it returns. Whenever a fact changes, the
+    functions depending on it are solved again, until nothing changes. Arguments and call results which are constant
+    are then replaced by the constant, leaving the rest to the function pipeline.
+  */
+class Optimization : public llvm::ModulePass, private cp::Facts {
+ public:
+  static char ID;
+
+  static llvm::Statistic constantArguments;
+  static llvm::Statistic constantResults;
+
+  Optimization() :
+      llvm::ModulePass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "InterproceduralConstantPropagation";
+  }
+
+  /** Functions changed by the last run. */
+  std::vector<llvm::Function *> const &changed() const {
+    return changed_;
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    arguments_.clear();
+    results_.clear();
+    changed_.clear();
+
+    llvm::SmallSetVector<llvm::Function *, 16> q;
+    for (llvm::Function &f : m) {
+      if (f.isDeclaration()) {
+        continue;
+      }
+      bool visible = hasVisibleCallSites(&f);
+      for (llvm::Argument &arg : f.args()) {
+        arguments_[&arg] = visible ? AValue() : AValue(AValue::Type::Top);
+      }
+      results_[&f] = AValue();
+      q.insert(&f);
+    }
+
+    while (not q.empty()) {
+      llvm::Function *f = q.pop_back_val();
+      cp::Analysis a;
+      a.solve(*f, this);
+      if (propagate(f, a, q)) {
+        for (llvm::User *u : f->users()) {
+          if (llvm::Instruction *ins = llvm::dyn_cast<llvm::Instruction>(u)) {
+            q.insert(ins->getFunction());
+          }
+        }
+      }
+    }
+
+    for (llvm::Function &f : m) {
+      if (not f.isDeclaration() and replace(&f)) {
+        changed_.push_back(&f);
+      }
+    }
+    return not changed_.empty();
+  }
+
+ private:
+
+  AValue argument(llvm::Argument *arg) const override {
+    auto i = arguments_.find(arg);
+    return i == arguments_.end() ? AValue(AValue::Type::Top) : i->second;
+  }
+
+  AValue result(llvm::Function *callee) const override {
+    auto i = results_.find(callee);
+    return i == results_.end() ? AValue(AValue::Type::Top) : i->second;
+  }
+
+  /** All call sites of a function are known if it is called and its address is used for nothing else. */
+  static bool hasVisibleCallSites(llvm::Function *f) {
+    if (f->use_empty()) {
+      return false;
+    }
+    for (llvm::Use &u : f->uses()) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(u.getUser());
+      if (call == nullptr or call->getCalledValue() != f) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /** Merges the values the function passes to its callees into their arguments, scheduling the callees whose
+      arguments changed. Returns true if the result of the function changed.
+    */
+  bool propagate(llvm::Function *f, cp::Analysis const &a, llvm::SmallSetVector<llvm::Function *, 16> &q) {
+    AValue &result = results_[f];
+    bool changed = false;
+    for (llvm::BasicBlock &b : *f) {
+      if (not a.isExecutable(&b)) {
+        continue;
+      }
+      if (llvm::ReturnInst *ret = llvm::dyn_cast<llvm::ReturnInst>(b.getTerminator())) {
+        if (ret->getReturnValue() != nullptr) {
+          changed = result.mergeWith(a.value(ret->getReturnValue())) or changed;
+        }
+      }
+      for (llvm::Instruction &ins : b) {
+        llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&ins);
+        llvm::Function *callee = call == nullptr ? nullptr : call->getCalledFunction();
+        if (callee == nullptr or callee->isDeclaration()) {
+          continue;
+        }
+        bool arguments = false;
+        for (llvm::Argument &arg : callee->args()) {
+          arguments = arguments_[&arg].mergeWith(a.value(call->getArgOperand(arg.getArgNo()))) or arguments;
+        }
+        if (arguments) {
+          q.insert(callee);
+        }
+      }
+    }
+    return changed;
+  }
+
+  bool replace(llvm::Function *f) {
+    bool changed = false;
+    for (llvm::Argument &arg : f->args()) {
+      AValue v = arguments_[&arg];
+      if (v.isConst() and not arg.use_empty()) {
+        arg.replaceAllUsesWith(llvm::ConstantInt::get(arg.getType(), v.value(), false));
+        ++constantArguments;
+        changed = true;
+      }
+    }
+    for (llvm::Instruction &ins : llvm::instructions(f)) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&ins);
+      if (call == nullptr or call->getCalledFunction() == nullptr or call->use_empty()) {
+        continue;
+      }
+      AValue v = result(call->getCalledFunction());
+      if (v.isConst()) {
+        // the call stays for its side effects
+        call->replaceAllUsesWith(llvm::ConstantInt::get(call->getType(), v.value(), false));
+        ++constantResults;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  llvm::DenseMap<llvm::Argument *, AValue> arguments_;
+  llvm::DenseMap<llvm::Function *, AValue> results_;
+  std::vector<llvm::Function *> changed_;
+};
+
+}
+}
+#endif
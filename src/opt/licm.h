@@ -0,0 +1,290 @@
+#ifndef OPT_LICM_H
+#define OPT_LICM_H
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "vrp.h"
+
+namespace mila {
+
+namespace licm {
+
+/** Globals a piece of code may read and write. Unknown effects may touch any memory. */
+class Effects {
+ public:
+  bool unknown = false;
+  llvm::SmallPtrSet<llvm::GlobalVariable *, 4> reads;
+  llvm::SmallPtrSet<llvm::GlobalVariable *, 4> writes;
+
+  void merge(Effects const &other) {
+    unknown = unknown or other.unknown;
+    reads.insert(other.reads.begin(), other.reads.end());
+    writes.insert(other.writes.begin(), other.writes.end());
+  }
+};
+
+/** Loop invariant code motion.
+
+    Loops are visited inner to outer. Pure computations whose operands are defined outside of the loop are hoisted to
+    the preheader if they cannot trap, divisions also when value ranges prove the divisor non-zero. Loads of globals
+    the loop does not write are hoisted too, and globals the loop stores to are kept in a register inside the loop,
+    loaded in the preheader and stored back in the exit blocks. Memory is only moved when every call in the loop has
+    known effects: either the callee is defined in the module, or its attributes say it does not touch the globals.
+    What moved is reported as optimization remarks.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic hoisted;
+  static llvm::Statistic promoted;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "LoopInvariantCodeMotion";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::LoopInfoWrapperPass>();
+    au.addRequired<llvm::DominatorTreeWrapperPass>();
+    au.addRequired<vrp::Analysis>();
+    au.setPreservesCFG();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    llvm::LoopInfo &li = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+    llvm::DominatorTree &dt = getAnalysis<llvm::DominatorTreeWrapperPass>().getDomTree();
+    ranges_ = &getAnalysis<vrp::Analysis>();
+    llvm::OptimizationRemarkEmitter ore(&f);
+    effects_.clear();
+    bool changed = false;
+    llvm::SmallVector<llvm::Loop *, 4> loops = li.getLoopsInPreorder();
+    for (auto i = loops.rbegin(), e = loops.rend(); i != e; ++i) {
+      changed = runOnLoop(*i, dt, ore) or changed;
+    }
+    return changed;
+  }
+
+ private:
+
+  bool runOnLoop(llvm::Loop *l, llvm::DominatorTree &dt, llvm::OptimizationRemarkEmitter &ore) {
+    llvm::BasicBlock *preheader = l->getLoopPreheader();
+    if (preheader == nullptr) {
+      return false;
+    }
+    llvm::Instruction *ip = preheader->getTerminator();
+
+    Effects loop;
+    Effects calls;
+    for (llvm::BasicBlock *b : l->blocks()) {
+      for (llvm::Instruction &ins : *b) {
+        accumulate(&ins, loop, calls);
+      }
+    }
+
+    unsigned moved = 0;
+    // dominators first so that chains of invariant instructions move together
+    for (llvm::BasicBlock *b : blocksInDominatorOrder(l, dt)) {
+      for (auto i = b->begin(), e = b->end(); i != e;) {
+        llvm::Instruction *ins = &*i++;
+        if (isHoistable(ins, l, loop)) {
+          ins->moveBefore(ip);
+          ++moved;
+        }
+      }
+    }
+    if (moved != 0) {
+      hoisted += moved;
+      ore.emit(llvm::OptimizationRemark(REMARKS, "Hoisted", l->getStartLoc(), l->getHeader())
+                   << "hoisted " << llvm::ore::NV("Instructions", moved) << " loop invariant instructions");
+    }
+    bool changed = moved != 0;
+
+    if (not loop.unknown and l->hasDedicatedExits()) {
+      for (llvm::GlobalVariable *g : loop.writes) {
+        if (not calls.reads.count(g) and not calls.writes.count(g)) {
+          promote(g, l, preheader);
+          ++promoted;
+          ore.emit(llvm::OptimizationRemark(REMARKS, "Promoted", l->getStartLoc(), l->getHeader())
+                       << "kept global " << llvm::ore::NV("Global", g) << " in a register");
+          changed = true;
+        }
+      }
+    }
+    return changed;
+  }
+
+  static llvm::SmallVector<llvm::BasicBlock *, 16> blocksInDominatorOrder(llvm::Loop *l, llvm::DominatorTree &dt) {
+    llvm::SmallVector<llvm::BasicBlock *, 16> result;
+    for (llvm::DomTreeNode *node : llvm::depth_first(dt.getNode(l->getHeader()))) {
+      if (l->contains(node->getBlock())) {
+        result.push_back(node->getBlock());
+      }
+    }
+    return result;
+  }
+
+  /** Pure instructions with invariant operands which cannot trap, and loads of globals nothing in the loop writes. */
+  bool isHoistable(llvm::Instruction *ins, llvm::Loop *l, Effects const &loop) const {
+    if (not l->hasLoopInvariantOperands(ins)) {
+      return false;
+    }
+    if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(ins)) {
+      llvm::GlobalVariable *g = llvm::dyn_cast<llvm::GlobalVariable>(load->getPointerOperand());
+      return g != nullptr and not load->isVolatile() and not loop.unknown and not loop.writes.count(g);
+    }
+    if (llvm::isa<llvm::BinaryOperator>(ins) or llvm::isa<llvm::CmpInst>(ins) or llvm::isa<llvm::CastInst>(ins)
+        or llvm::isa<llvm::SelectInst>(ins)) {
+      return llvm::isSafeToSpeculativelyExecute(ins) or isSafeDivision(ins);
+    }
+    return false;
+  }
+
+  /** A division traps if the divisor is zero, or if it is -1 and the dividend the smallest value. */
+  bool isSafeDivision(llvm::Instruction *ins) const {
+    if (ins->getOpcode() != llvm::Instruction::SDiv and ins->getOpcode() != llvm::Instruction::SRem) {
+      return false;
+    }
+    llvm::Value *dividend = ins->getOperand(0);
+    llvm::Value *divisor = ins->getOperand(1);
+    return ranges_->isNonZero(divisor)
+        and (not ranges_->range(divisor).contains(-1) or not ranges_->range(dividend).contains(Range::minValue()));
+  }
+
+  /** Adds the memory effects of the instruction to the loop, and those of calls to the calls as well. */
+  void accumulate(llvm::Instruction *ins, Effects &loop, Effects &calls) {
+    if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(ins)) {
+      access(load->getPointerOperand(), load->isVolatile(), loop.reads, loop);
+    } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
+      access(store->getPointerOperand(), store->isVolatile(), loop.writes, loop);
+    } else if (llvm::isa<llvm::CallInst>(ins) or llvm::isa<llvm::InvokeInst>(ins)) {
+      Effects const &e = effects(llvm::CallSite(ins));
+      loop.merge(e);
+      calls.merge(e);
+    } else if (ins->mayReadOrWriteMemory()) {
+      loop.unknown = true;
+    }
+  }
+
+  static void access(llvm::Value *ptr, bool isVolatile, llvm::SmallPtrSet<llvm::GlobalVariable *, 4> &into,
+                     Effects &e) {
+    if (llvm::isa<llvm::AllocaInst>(ptr) and not isVolatile) {
+      return;
+    }
+    llvm::GlobalVariable *g = llvm::dyn_cast<llvm::GlobalVariable>(ptr);
+    if (g == nullptr or isVolatile) {
+      e.unknown = true;
+    } else {
+      into.insert(g);
+    }
+  }
+
+  /** Effects of a call. Functions defined in the module are scanned, calls still being scanned up the stack are
+      recursive and assumed to do anything.
+    */
+  Effects const &effects(llvm::CallSite cs) {
+    static Effects const none;
+    static Effects const any = [] {
+      Effects e;
+      e.unknown = true;
+      return e;
+    }();
+    if (cs.doesNotAccessMemory() or cs.onlyAccessesInaccessibleMemory()) {
+      return none;
+    }
+    llvm::Function *callee = cs.getCalledFunction();
+    if (callee == nullptr or callee->isDeclaration()) {
+      return any;
+    }
+    auto i = effects_.find(callee);
+    if (i != effects_.end()) {
+      return i->second;
+    }
+    effects_[callee] = any;
+    Effects result;
+    Effects ignored;
+    for (llvm::Instruction &ins : llvm::instructions(callee)) {
+      accumulate(&ins, result, ignored);
+    }
+    return effects_[callee] = result;
+  }
+
+  /** Keeps the global in a register while the loop runs. Every exit stores it back, the value loaded in the
+      preheader if the loop did not change it, which is harmless as nothing else can observe the global meanwhile.
+    */
+  void promote(llvm::GlobalVariable *g, llvm::Loop *l, llvm::BasicBlock *preheader) {
+    llvm::SSAUpdater ssa;
+    ssa.Initialize(g->getValueType(), g->getName());
+    ssa.AddAvailableValue(preheader, new llvm::LoadInst(g, g->getName() + ".promoted", preheader->getTerminator()));
+
+    // loads are only replaced at the end, the values stored may be loads of the global themselves
+    llvm::DenseMap<llvm::LoadInst *, llvm::Value *> replacement;
+    llvm::SmallVector<llvm::LoadInst *, 8> liveIn;
+    llvm::SmallVector<llvm::StoreInst *, 8> stores;
+    for (llvm::BasicBlock *b : l->blocks()) {
+      llvm::Value *current = nullptr;
+      for (llvm::Instruction &ins : *b) {
+        if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+          if (load->getPointerOperand() == g) {
+            if (current != nullptr) {
+              replacement[load] = current;
+            } else {
+              liveIn.push_back(load);
+            }
+          }
+        } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+          if (store->getPointerOperand() == g) {
+            current = store->getValueOperand();
+            stores.push_back(store);
+          }
+        }
+      }
+      if (current != nullptr) {
+        ssa.AddAvailableValue(b, current);
+      }
+    }
+    for (llvm::LoadInst *load : liveIn) {
+      replacement[load] = ssa.GetValueInMiddleOfBlock(load->getParent());
+    }
+
+    llvm::SmallVector<llvm::BasicBlock *, 4> exits;
+    l->getUniqueExitBlocks(exits);
+    for (llvm::BasicBlock *exit : exits) {
+      new llvm::StoreInst(ssa.GetValueInMiddleOfBlock(exit), g, &*exit->getFirstInsertionPt());
+    }
+
+    for (auto &r : replacement) {
+      llvm::Value *v = r.second;
+      for (auto i = replacement.end(); llvm::isa<llvm::LoadInst>(v)
+          and (i = replacement.find(llvm::cast<llvm::LoadInst>(v))) != replacement.end();) {
+        v = i->second;
+      }
+      r.first->replaceAllUsesWith(v);
+    }
+    for (llvm::StoreInst *store : stores) {
+      store->eraseFromParent();
+    }
+    for (auto &r : replacement) {
+      r.first->eraseFromParent();
+    }
+  }
+
+  static constexpr const char *REMARKS = "mila-licm";
+
+  llvm::DenseMap<llvm::Function *, Effects> effects_;
+  vrp::Analysis const *ranges_ = nullptr;
+};
+
+}
+}
+#endif
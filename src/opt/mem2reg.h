@@ -0,0 +1,241 @@
+#ifndef OPT_MEM2REG_H
+#define OPT_MEM2REG_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace mem2reg {
+
+/** Promotes local variables to SSA registers.
+
+    Variables the compiler allocates for locals and arguments are promoted if their address is only used to load and
+    store, the same condition cp uses to track them. Phi nodes are placed at the iterated dominance frontiers of the
+    stores and the loads are then renamed to the reaching values by walking the dominator tree.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic loadsBefore;
+  static llvm::Statistic storesBefore;
+  static llvm::Statistic loadsAfter;
+  static llvm::Statistic storesAfter;
+  static llvm::Statistic promoted;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "PromoteMemoryToRegisters";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::DominatorTreeWrapperPass>();
+    au.setPreservesCFG();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    countAccesses(f, loadsBefore, storesBefore);
+
+    allocas_.clear();
+    index_.clear();
+    for (llvm::Instruction &ins : f.getEntryBlock()) {
+      llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(&ins);
+      if (alloca != nullptr and not alloca->isArrayAllocation() and cp::Analysis::isTracked(alloca)) {
+        index_[alloca] = allocas_.size();
+        allocas_.push_back(alloca);
+      }
+    }
+
+    if (not allocas_.empty()) {
+      llvm::DominatorTree &dt = getAnalysis<llvm::DominatorTreeWrapperPass>().getDomTree();
+      removeUnreachableAccesses(f, dt);
+      computeFrontiers(f, dt);
+      placePhis(dt);
+      rename(f, dt);
+      for (llvm::AllocaInst *alloca : allocas_) {
+        alloca->eraseFromParent();
+      }
+      promoted += allocas_.size();
+    }
+
+    countAccesses(f, loadsAfter, storesAfter);
+    return not allocas_.empty();
+  }
+
+ private:
+
+  static void countAccesses(llvm::Function &f, llvm::Statistic &loads, llvm::Statistic &stores) {
+    for (llvm::Instruction &ins : llvm::instructions(f)) {
+      if (llvm::isa<llvm::LoadInst>(ins)) {
+        ++loads;
+      } else if (llvm::isa<llvm::StoreInst>(ins)) {
+        ++stores;
+      }
+    }
+  }
+
+  /** Returns the index of the promoted variable the pointer refers to, or -1. */
+  int variable(llvm::Value *ptr) const {
+    auto i = index_.find(ptr);
+    return i == index_.end() ? -1 : static_cast<int>(i->second);
+  }
+
+  /** Code the dominator tree does not cover is never executed, its loads may read anything. */
+  void removeUnreachableAccesses(llvm::Function &f, llvm::DominatorTree &dt) {
+    for (llvm::BasicBlock &b : f) {
+      if (dt.isReachableFromEntry(&b)) {
+        continue;
+      }
+      for (auto i = b.begin(), e = b.end(); i != e;) {
+        llvm::Instruction *ins = &*i++;
+        if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(ins)) {
+          if (variable(load->getPointerOperand()) != -1) {
+            load->replaceAllUsesWith(llvm::UndefValue::get(load->getType()));
+            load->eraseFromParent();
+          }
+        } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
+          if (variable(store->getPointerOperand()) != -1) {
+            store->eraseFromParent();
+          }
+        }
+      }
+    }
+  }
+
+  /** Dominance frontiers of the reachable blocks, computed from the dominator tree by walking up from the
+      predecessors of every join point (Cooper, Harvey & Kennedy).
+    */
+  void computeFrontiers(llvm::Function &f, llvm::DominatorTree &dt) {
+    frontiers_.clear();
+    for (llvm::BasicBlock &b : f) {
+      if (not dt.isReachableFromEntry(&b) or b.getSinglePredecessor() != nullptr) {
+        continue;
+      }
+      llvm::DomTreeNode *idom = dt.getNode(&b)->getIDom();
+      for (llvm::BasicBlock *pred : llvm::predecessors(&b)) {
+        if (not dt.isReachableFromEntry(pred)) {
+          continue;
+        }
+        for (llvm::DomTreeNode *runner = dt.getNode(pred); runner != idom; runner = runner->getIDom()) {
+          frontiers_[runner->getBlock()].insert(&b);
+        }
+      }
+    }
+  }
+
+  /** Places a phi node for each variable at the iterated dominance frontier of the blocks storing to it. */
+  void placePhis(llvm::DominatorTree &dt) {
+    phis_.clear();
+    for (unsigned v = 0, e = allocas_.size(); v != e; ++v) {
+      llvm::AllocaInst *alloca = allocas_[v];
+      llvm::SmallPtrSet<llvm::BasicBlock *, 16> placed;
+      llvm::SmallVector<llvm::BasicBlock *, 16> q;
+      for (llvm::User *u : alloca->users()) {
+        if (llvm::isa<llvm::StoreInst>(u)) {
+          q.push_back(llvm::cast<llvm::StoreInst>(u)->getParent());
+        }
+      }
+      while (not q.empty()) {
+        llvm::BasicBlock *b = q.pop_back_val();
+        auto df = frontiers_.find(b);
+        if (df == frontiers_.end()) {
+          continue;
+        }
+        for (llvm::BasicBlock *join : df->second) {
+          if (not placed.insert(join).second) {
+            continue;
+          }
+          llvm::PHINode *phi = llvm::PHINode::Create(alloca->getAllocatedType(), 2, alloca->getName(), &join->front());
+          phis_[phi] = v;
+          // a phi is a new definition of the variable as well
+          q.push_back(join);
+        }
+      }
+    }
+  }
+
+  /** Walks the dominator tree replacing loads by the values reaching them and filling in the phi nodes. */
+  void rename(llvm::Function &f, llvm::DominatorTree &dt) {
+    struct Item {
+      llvm::BasicBlock *b;
+      std::vector<llvm::Value *> values;
+    };
+
+    std::vector<Item> stack;
+    stack.push_back(Item{&f.getEntryBlock(), std::vector<llvm::Value *>(allocas_.size())});
+    for (unsigned v = 0, e = allocas_.size(); v != e; ++v) {
+      stack.back().values[v] = llvm::UndefValue::get(allocas_[v]->getAllocatedType());
+    }
+
+    while (not stack.empty()) {
+      Item item = std::move(stack.back());
+      stack.pop_back();
+      std::vector<llvm::Value *> &current = item.values;
+
+      for (auto i = item.b->begin(), e = item.b->end(); i != e;) {
+        llvm::Instruction *ins = &*i++;
+        if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(ins)) {
+          auto v = phis_.find(phi);
+          if (v != phis_.end()) {
+            current[v->second] = phi;
+          }
+        } else if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(ins)) {
+          int v = variable(load->getPointerOperand());
+          if (v != -1) {
+            load->replaceAllUsesWith(current[v]);
+            load->eraseFromParent();
+          }
+        } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(ins)) {
+          int v = variable(store->getPointerOperand());
+          if (v != -1) {
+            current[v] = store->getValueOperand();
+            store->eraseFromParent();
+          }
+        }
+      }
+
+      // one incoming value per edge, so branches with both targets the same are handled too
+      for (llvm::BasicBlock *succ : llvm::successors(item.b)) {
+        for (auto i = succ->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+          auto v = phis_.find(phi);
+          if (v != phis_.end()) {
+            phi->addIncoming(current[v->second], item.b);
+          }
+        }
+      }
+
+      for (llvm::DomTreeNode *child : *dt.getNode(item.b)) {
+        stack.push_back(Item{child->getBlock(), current});
+      }
+    }
+
+    // edges from unreachable code carry nothing
+    for (auto &i : phis_) {
+      llvm::PHINode *phi = i.first;
+      for (llvm::BasicBlock *pred : llvm::predecessors(phi->getParent())) {
+        if (not dt.isReachableFromEntry(pred)) {
+          phi->addIncoming(llvm::UndefValue::get(phi->getType()), pred);
+        }
+      }
+    }
+  }
+
+  std::vector<llvm::AllocaInst *> allocas_;
+  llvm::DenseMap<llvm::Value *, unsigned> index_;
+  llvm::DenseMap<llvm::BasicBlock *, llvm::SmallSetVector<llvm::BasicBlock *, 4>> frontiers_;
+  llvm::DenseMap<llvm::PHINode *, unsigned> phis_;
+};
+
+}
+}
+#endif
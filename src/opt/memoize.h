@@ -0,0 +1,144 @@
+#ifndef OPT_MEMOIZE_H
+#define OPT_MEMOIZE_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "runtime.h"
+#include "attributes.h"
+
+namespace mila {
+
+namespace memoize {
+
+/** Memoizes pure recursive functions.
+
+    Only functions the attribute inference marked as mila-pure are memoized, they touch no memory so their result
+    depends on the arguments alone. Of those only recursive functions with arguments are worth a table lookup per
+    call. The body is moved to an internal function and the original becomes a wrapper which asks the runtime table of
+    the function first and only calls the body and stores its result on a miss. The recursive calls in the body still
+    call the wrapper, so that the subproblems are memoized as well.
+  */
+class Optimization : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  static llvm::Statistic memoized;
+
+  Optimization() :
+      llvm::ModulePass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "Memoization";
+  }
+
+  /** Wrappers and bodies made by the last run. */
+  std::vector<llvm::Function *> const &changed() const {
+    return changed_;
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    changed_.clear();
+    std::vector<llvm::Function *> candidates;
+    llvm::CallGraph cg(m);
+    for (auto i = llvm::scc_begin(&cg); not i.isAtEnd(); ++i) {
+      if (not i.hasLoop()) {
+        continue;
+      }
+      for (llvm::CallGraphNode *node : *i) {
+        llvm::Function *f = node->getFunction();
+        if (f != nullptr and not f->isDeclaration() and f->arg_size() != 0
+            and f->hasFnAttribute(attributes::Optimization::PURE)) {
+          candidates.push_back(f);
+        }
+      }
+    }
+    for (llvm::Function *f : candidates) {
+      memoize(f);
+    }
+    return not changed_.empty();
+  }
+
+ private:
+
+  void memoize(llvm::Function *f) {
+    llvm::Module *m = f->getParent();
+    llvm::LLVMContext &c = m->getContext();
+    llvm::Type *t_int = llvm::Type::getInt32Ty(c);
+    llvm::Type *t_ptr = t_int->getPointerTo();
+
+    llvm::Function *lookup = runtime(m, "memo_lookup_",
+                                     llvm::FunctionType::get(t_int, {t_int, t_ptr, t_ptr}, false));
+    llvm::Function *store = runtime(m, "memo_store_",
+                                    llvm::FunctionType::get(llvm::Type::getVoidTy(c), {t_int, t_ptr, t_int}, false));
+
+    // move the body to its own function
+    llvm::Function *body = llvm::Function::Create(f->getFunctionType(), llvm::GlobalValue::InternalLinkage,
+                                                  f->getName() + ".body", m);
+    body->copyAttributesFrom(f);
+    body->setLinkage(llvm::GlobalValue::InternalLinkage);
+    body->getBasicBlockList().splice(body->end(), f->getBasicBlockList());
+    for (auto i = f->arg_begin(), j = body->arg_begin(), e = f->arg_end(); i != e; ++i, ++j) {
+      j->setName(i->getName());
+      i->replaceAllUsesWith(&*j);
+    }
+
+    // the wrapper reads and writes the table
+    f->removeFnAttr(llvm::Attribute::ReadNone);
+    f->removeFnAttr(llvm::Attribute::ReadOnly);
+    f->removeFnAttr(attributes::Optimization::PURE);
+
+    unsigned arity = static_cast<unsigned>(f->arg_size());
+    llvm::Value *table = llvm::ConstantInt::get(t_int, memo::table(f->getName().str(), arity));
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(c, "entry", f);
+    llvm::BasicBlock *hit = llvm::BasicBlock::Create(c, "hit", f);
+    llvm::BasicBlock *miss = llvm::BasicBlock::Create(c, "miss", f);
+
+    llvm::IRBuilder<> b(entry);
+    llvm::Value *keys = b.CreateAlloca(llvm::ArrayType::get(t_int, arity), nullptr, "keys");
+    llvm::Value *slot = b.CreateAlloca(t_int, nullptr, "slot");
+    std::vector<llvm::Value *> args;
+    for (llvm::Argument &arg : f->args()) {
+      b.CreateStore(&arg, b.CreateConstInBoundsGEP2_32(nullptr, keys, 0, arg.getArgNo()));
+      args.push_back(&arg);
+    }
+    llvm::Value *first = b.CreateConstInBoundsGEP2_32(nullptr, keys, 0, 0);
+    llvm::Value *found = b.CreateCall(lookup, {table, first, slot});
+    b.CreateCondBr(b.CreateICmpNE(found, llvm::ConstantInt::get(t_int, 0)), hit, miss);
+
+    b.SetInsertPoint(hit);
+    b.CreateRet(b.CreateLoad(slot));
+
+    b.SetInsertPoint(miss);
+    llvm::Value *result = b.CreateCall(body, args);
+    b.CreateCall(store, {table, first, result});
+    b.CreateRet(result);
+
+    changed_.push_back(f);
+    changed_.push_back(body);
+    ++memoized;
+  }
+
+  /** Declares a memo runtime function, which only touches its table and the arrays passed to it. */
+  static llvm::Function *runtime(llvm::Module *m, char const *name, llvm::FunctionType *type) {
+    llvm::Function *result = m->getFunction(name);
+    if (result == nullptr) {
+      result = llvm::Function::Create(type, llvm::GlobalValue::ExternalLinkage, name, m);
+      result->setCallingConv(llvm::CallingConv::C);
+      result->addFnAttr(llvm::Attribute::InaccessibleMemOrArgMemOnly);
+      result->addFnAttr(llvm::Attribute::NoUnwind);
+      result->addFnAttr(llvm::Attribute::NoRecurse);
+    }
+    return result;
+  }
+
+  std::vector<llvm::Function *> changed_;
+};
+
+}
+}
+#endif
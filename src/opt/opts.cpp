@@ -1,11 +1,120 @@
+#include "adce.h"
+#include "attributes.h"
 #include "cp.h"
 #include "dce.h"
 #include "dse.h"
+#include "globals.h"
+#include "gvn.h"
+#include "indvars.h"
+#include "inliner.h"
+#include "ipcp.h"
+#include "licm.h"
+#include "mem2reg.h"
+#include "memoize.h"
+#include "pgo.h"
+#include "reassociate.h"
+#include "rotation.h"
+#include "simplify.h"
+#include "specialization.h"
+#include "threading.h"
+#include "tiering.h"
 #include "unrolling.h"
+#include "vrp.h"
 
 
 char mila::cp::Analysis::ID = 0;
+llvm::Statistic mila::cp::Analysis::visits = {"mila-cp", "visits", "Blocks visited by the analysis"};
+llvm::Statistic mila::cp::Analysis::pushes = {"mila-cp", "pushes", "Blocks scheduled by the analysis"};
+llvm::Statistic mila::cp::Analysis::duplicates = {"mila-cp", "duplicates", "Schedules of blocks already queued"};
 char mila::cp::Optimization::ID = 0;
+llvm::Statistic mila::cp::Optimization::constants = {"mila-cp", "constants", "Instructions replaced by constants"};
+llvm::Statistic mila::cp::Optimization::branches = {"mila-cp", "branches", "Conditional branches folded"};
+llvm::Statistic mila::cp::Optimization::unreachable = {"mila-cp", "unreachable", "Unreachable blocks removed"};
 char mila::dce::Optimization::ID = 0;
+llvm::Statistic mila::dce::Optimization::removed = {"mila-dce", "removed", "Dead instructions removed"};
+char mila::adce::Optimization::ID = 0;
+llvm::Statistic mila::adce::Optimization::branches = {"mila-adce", "branches", "Dead branches removed"};
+llvm::Statistic mila::adce::Optimization::removed = {"mila-adce", "removed", "Dead instructions removed"};
+char mila::attributes::Optimization::ID = 0;
+llvm::Statistic mila::attributes::Optimization::readnone = {"mila-attributes", "readnone", "Functions marked readnone"};
+llvm::Statistic mila::attributes::Optimization::readonly = {"mila-attributes", "readonly", "Functions marked readonly"};
+llvm::Statistic mila::attributes::Optimization::inaccessiblememonly =
+    {"mila-attributes", "inaccessiblememonly", "Functions marked inaccessiblememonly"};
+llvm::Statistic mila::attributes::Optimization::nounwind = {"mila-attributes", "nounwind", "Functions marked nounwind"};
+llvm::Statistic mila::attributes::Optimization::norecurse =
+    {"mila-attributes", "norecurse", "Functions marked norecurse"};
 char mila::dse::Optimization::ID = 0;
-char mila::unrolling::Optimization::ID = 0;
\ No newline at end of file
+llvm::Statistic mila::dse::Optimization::removed = {"mila-dse", "removed", "Dead stores and variables removed"};
+char mila::globals::Optimization::ID = 0;
+llvm::Statistic mila::globals::Optimization::promoted = {"mila-globals", "promoted", "Globals promoted to locals"};
+llvm::Statistic mila::globals::Optimization::spills = {"mila-globals", "spills", "Stores of shadows to their globals"};
+llvm::Statistic mila::globals::Optimization::reloads = {"mila-globals", "reloads", "Reloads of shadows after calls"};
+char mila::gvn::Optimization::ID = 0;
+char mila::inliner::Optimization::ID = 0;
+char mila::ipcp::Optimization::ID = 0;
+char mila::licm::Optimization::ID = 0;
+llvm::Statistic mila::licm::Optimization::hoisted = {"mila-licm", "hoisted", "Loop invariant instructions hoisted"};
+llvm::Statistic mila::licm::Optimization::promoted = {"mila-licm", "promoted", "Globals kept in registers in loops"};
+char mila::indvars::Optimization::ID = 0;
+llvm::Statistic mila::indvars::Optimization::exitValues = {"mila-indvars", "exitValues", "Loop exit values replaced"};
+llvm::Statistic mila::indvars::Optimization::deleted = {"mila-indvars", "deleted", "Dead loops deleted"};
+char mila::mem2reg::Optimization::ID = 0;
+char mila::memoize::Optimization::ID = 0;
+llvm::Statistic mila::memoize::Optimization::memoized = {"mila-memoize", "memoized", "Functions memoized"};
+llvm::Statistic mila::mem2reg::Optimization::loadsBefore = {"mila-mem2reg", "loadsBefore", "Loads before promotion"};
+llvm::Statistic mila::mem2reg::Optimization::storesBefore = {"mila-mem2reg", "storesBefore", "Stores before promotion"};
+llvm::Statistic mila::mem2reg::Optimization::loadsAfter = {"mila-mem2reg", "loadsAfter", "Loads after promotion"};
+llvm::Statistic mila::mem2reg::Optimization::storesAfter = {"mila-mem2reg", "storesAfter", "Stores after promotion"};
+llvm::Statistic mila::mem2reg::Optimization::promoted = {"mila-mem2reg", "promoted", "Variables promoted to registers"};
+llvm::Statistic mila::gvn::Optimization::instructionsBefore =
+    {"mila-gvn", "instructionsBefore", "Instructions before value numbering"};
+llvm::Statistic mila::gvn::Optimization::instructionsAfter =
+    {"mila-gvn", "instructionsAfter", "Instructions after value numbering"};
+llvm::Statistic mila::gvn::Optimization::expressions = {"mila-gvn", "expressions", "Redundant expressions removed"};
+llvm::Statistic mila::gvn::Optimization::loads = {"mila-gvn", "loads", "Redundant loads removed"};
+llvm::Statistic mila::inliner::Optimization::callSites = {"mila-inline", "callSites", "Call sites considered"};
+llvm::Statistic mila::inliner::Optimization::inlined = {"mila-inline", "inlined", "Call sites inlined"};
+llvm::Statistic mila::ipcp::Optimization::constantArguments =
+    {"mila-ipcp", "constantArguments", "Arguments replaced by constants"};
+llvm::Statistic mila::ipcp::Optimization::constantResults =
+    {"mila-ipcp", "constantResults", "Call results replaced by constants"};
+char mila::pgo::Instrumentation::ID = 0;
+char mila::pgo::Annotation::ID = 0;
+llvm::Statistic mila::pgo::Annotation::annotated = {"mila-pgo", "annotated", "Functions annotated with a profile"};
+llvm::Statistic mila::pgo::Annotation::stale = {"mila-pgo", "stale", "Functions whose profile did not match"};
+char mila::reassociate::Optimization::ID = 0;
+char mila::rotation::Optimization::ID = 0;
+llvm::Statistic mila::rotation::Optimization::rotated = {"mila-rotate", "rotated", "Loops rotated"};
+llvm::Statistic mila::rotation::Optimization::duplicated =
+    {"mila-rotate", "duplicated", "Instructions copied into preheaders"};
+char mila::simplify::Optimization::ID = 0;
+llvm::Statistic mila::simplify::Optimization::identities = {"mila-simplify", "identities", "Instructions simplified"};
+llvm::Statistic mila::simplify::Optimization::compares =
+    {"mila-simplify", "compares", "Compares of compares simplified"};
+char mila::specialization::Optimization::ID = 0;
+llvm::Statistic mila::specialization::Optimization::clones = {"mila-specialize", "clones", "Specialized clones made"};
+llvm::Statistic mila::specialization::Optimization::callSites =
+    {"mila-specialize", "callSites", "Call sites redirected to clones"};
+llvm::Statistic mila::specialization::Optimization::savedInstructions =
+    {"mila-specialize", "savedInstructions", "Instructions estimated to fold away in clones"};
+char mila::threading::Optimization::ID = 0;
+llvm::Statistic mila::threading::Optimization::threaded = {"mila-thread", "threaded", "Edges threaded"};
+llvm::Statistic mila::threading::Optimization::duplicated =
+    {"mila-thread", "duplicated", "Instructions copied for threaded edges"};
+char mila::tiering::Instrumentation::ID = 0;
+llvm::Statistic mila::tiering::Instrumentation::loops = {"mila-tiering", "loops", "Loops of main instrumented"};
+llvm::Statistic mila::tiering::Instrumentation::becameHot =
+    {"mila-tiering", "becameHot", "Functions and loops which became hot"};
+llvm::Statistic mila::tiering::Instrumentation::switched =
+    {"mila-tiering", "switched", "Functions and loops switched to optimized code"};
+llvm::Statistic mila::tiering::Instrumentation::microseconds =
+    {"mila-tiering", "microseconds", "Microseconds of background compilation"};
+char mila::tiering::OnStackReplacement::ID = 0;
+char mila::unrolling::Optimization::ID = 0;
+llvm::Statistic mila::unrolling::Optimization::full = {"mila-unroll", "full", "Loops fully unrolled"};
+llvm::Statistic mila::unrolling::Optimization::partial = {"mila-unroll", "partial", "Loops partially unrolled"};
+char mila::vrp::Analysis::ID = 0;
+char mila::vrp::Optimization::ID = 0;
+llvm::Statistic mila::vrp::Optimization::constants = {"mila-vrp", "constants", "Constant ranges folded"};
+llvm::Statistic mila::vrp::Optimization::compares = {"mila-vrp", "compares", "Compares turned into equalities"};
+llvm::Statistic mila::vrp::Optimization::branches = {"mila-vrp", "branches", "Conditional branches folded"};
\ No newline at end of file
@@ -0,0 +1,190 @@
+#ifndef OPT_PGO_H
+#define OPT_PGO_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/MDBuilder.h"
+#include "runtime.h"
+
+namespace mila {
+
+namespace pgo {
+
+/** Instrumentation collecting an execution profile.
+
+    Every block increments its counter when it starts and every conditional branch adds its condition to a counter of
+    its own, which is how often it was taken, the number of times it was not taken being the difference to the count
+    of its block. The counters live in the runtime, which writes them out once the program finishes, and the code
+    increments them in place through their addresses. Blocks and branches are numbered in the order the compiler
+    emitted them, the pass runs before any optimization so that the annotation of the next compilation of the same
+    program finds them again.
+  */
+class Instrumentation : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  Instrumentation() :
+      llvm::ModulePass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "ProfileInstrumentation";
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    bool changed = false;
+    for (llvm::Function &f : m) {
+      if (not f.isDeclaration()) {
+        instrument(f);
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  /** The blocks of the function in order and its conditional branches in the order of their blocks. */
+  static void number(llvm::Function &f, std::vector<llvm::BasicBlock *> &blocks,
+                     std::vector<llvm::BranchInst *> &branches) {
+    for (llvm::BasicBlock &b : f) {
+      blocks.push_back(&b);
+      llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(b.getTerminator());
+      if (br != nullptr and br->isConditional()) {
+        branches.push_back(br);
+      }
+    }
+  }
+
+ private:
+
+  static void instrument(llvm::Function &f) {
+    std::vector<llvm::BasicBlock *> blocks;
+    std::vector<llvm::BranchInst *> branches;
+    number(f, blocks, branches);
+    uint64_t *counters = profile::counters(f.getName().str(), blocks.size(), branches.size());
+    for (size_t i = 0; i != blocks.size(); ++i) {
+      // after the variables of the entry block, mem2reg only promotes those
+      auto ip = blocks[i]->getFirstInsertionPt();
+      while (llvm::isa<llvm::AllocaInst>(*ip)) {
+        ++ip;
+      }
+      llvm::IRBuilder<> b(blocks[i], ip);
+      increment(b, counters + i, b.getInt64(1));
+    }
+    for (size_t i = 0; i != branches.size(); ++i) {
+      llvm::IRBuilder<> b(branches[i]);
+      increment(b, counters + blocks.size() + i, b.CreateZExt(branches[i]->getCondition(), b.getInt64Ty()));
+    }
+  }
+
+  static void increment(llvm::IRBuilder<> &b, uint64_t *counter, llvm::Value *by) {
+    llvm::Value *address = b.CreateIntToPtr(b.getInt64(reinterpret_cast<uintptr_t>(counter)),
+                                            b.getInt64Ty()->getPointerTo());
+    b.CreateStore(b.CreateAdd(b.CreateLoad(address), by), address);
+  }
+};
+
+/** Annotates the code with a profile collected by the instrumentation.
+
+    Conditional branches get their branch weights, functions their entry counts and calls the count of their block as
+    mila.count metadata, which the inliner weighs. Blocks which never ran are moved to the end of their function, out
+    of the way of the hot code, and code generation lays out the rest by the branch weights. The unroller reads the
+    weights of loop exits. Functions whose blocks and branches do not match their profile have changed since it was
+    collected, and are left alone.
+  */
+class Annotation : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  static llvm::Statistic annotated;
+  static llvm::Statistic stale;
+
+  explicit Annotation(std::map<std::string, profile::Counts> const &profile) :
+      llvm::ModulePass(ID),
+      profile_(profile) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "ProfileAnnotation";
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    bool changed = false;
+    for (llvm::Function &f : m) {
+      auto i = profile_.find(f.getName().str());
+      if (not f.isDeclaration() and i != profile_.end()) {
+        changed = annotate(f, i->second) or changed;
+      }
+    }
+    return changed;
+  }
+
+ private:
+
+  bool annotate(llvm::Function &f, profile::Counts const &counts) {
+    llvm::LLVMContext &c = f.getContext();
+    std::vector<llvm::BasicBlock *> blocks;
+    std::vector<llvm::BranchInst *> branches;
+    Instrumentation::number(f, blocks, branches);
+    if (blocks.size() != counts.blocks.size() or branches.size() != counts.branches.size()) {
+      llvm::OptimizationRemarkEmitter ore(&f);
+      ore.emit(llvm::OptimizationRemarkMissed(REMARKS, "Stale", &f)
+                   << "profile of " << llvm::ore::NV("Function", &f) << " does not match its code");
+      ++stale;
+      return false;
+    }
+
+    llvm::DenseMap<llvm::BasicBlock *, uint64_t> count;
+    for (size_t i = 0; i != blocks.size(); ++i) {
+      count[blocks[i]] = counts.blocks[i];
+    }
+    f.setEntryCount(counts.blocks[0]);
+    for (size_t i = 0; i != branches.size(); ++i) {
+      uint64_t taken = counts.branches[i];
+      uint64_t total = count[branches[i]->getParent()];
+      branches[i]->setMetadata(llvm::LLVMContext::MD_prof, weights(c, taken, total > taken ? total - taken : 0));
+    }
+    for (llvm::BasicBlock *b : blocks) {
+      llvm::Metadata *n = llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(llvm::Type::getInt64Ty(c), count[b]));
+      for (llvm::Instruction &ins : *b) {
+        if (llvm::isa<llvm::CallInst>(ins)) {
+          ins.setMetadata("mila.count", llvm::MDNode::get(c, n));
+        }
+      }
+    }
+
+    // the entry stays first
+    for (size_t i = 1; i != blocks.size(); ++i) {
+      if (counts.blocks[i] == 0) {
+        blocks[i]->moveAfter(&f.back());
+      }
+    }
+    ++annotated;
+    return true;
+  }
+
+  /** Branch weights are 32bit, larger counts are scaled down together. */
+  static llvm::MDNode *weights(llvm::LLVMContext &c, uint64_t taken, uint64_t notTaken) {
+    unsigned shift = 0;
+    while ((std::max(taken, notTaken) >> shift) > std::numeric_limits<uint32_t>::max()) {
+      ++shift;
+    }
+    return llvm::MDBuilder(c).createBranchWeights(static_cast<uint32_t>(taken >> shift),
+                                                  static_cast<uint32_t>(notTaken >> shift));
+  }
+
+  static constexpr const char *REMARKS = "mila-pgo";
+
+  std::map<std::string, profile::Counts> profile_;
+};
+
+}
+}
+#endif
@@ -0,0 +1,198 @@
+#ifndef OPT_REASSOCIATE_H
+#define OPT_REASSOCIATE_H
+
+#include <algorithm>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/PostOrderIterator.h"
+
+namespace mila {
+
+namespace reassociate {
+
+/** Reassociates sums and products.
+
+    Subtractions of constants become additions of their negation first. Then every tree of single use additions, or
+    of multiplications, is flattened into its leaves, which are ranked by where they are defined: arguments first,
+    then instructions in reverse postorder. The constant leaves are folded into one and the tree is rebuilt as a chain
+    combining the leaves from the lowest rank, with the constant last. Arithmetic on integers wraps, so the order
+    does not change the result. Values defined early are thus combined first and shared by gvn, and constants end up
+    next to each other where cp folds them.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "Reassociation";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.setPreservesCFG();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    bool changed = false;
+    rank_.clear();
+    unsigned rank = 0;
+    for (llvm::Argument &arg : f.args()) {
+      rank_[&arg] = ++rank;
+    }
+    llvm::ReversePostOrderTraversal<llvm::Function *> rpo(&f);
+    std::vector<llvm::BinaryOperator *> ops;
+    for (llvm::BasicBlock *b : rpo) {
+      for (llvm::Instruction &ins : *b) {
+        if (llvm::BinaryOperator *op = llvm::dyn_cast<llvm::BinaryOperator>(&ins)) {
+          ops.push_back(op);
+        }
+      }
+    }
+    for (llvm::BinaryOperator *&op : ops) {
+      changed = canonicalizeSub(op) or changed;
+    }
+    for (llvm::BasicBlock *b : rpo) {
+      for (llvm::Instruction &ins : *b) {
+        rank_[&ins] = ++rank;
+      }
+    }
+
+    // roots are the additions and multiplications which are not a part of a larger tree
+    std::vector<llvm::BinaryOperator *> roots;
+    for (llvm::BinaryOperator *op : ops) {
+      if (isAssociative(op) and not isInterior(op, op->getOpcode())) {
+        roots.push_back(op);
+      }
+    }
+    for (llvm::BinaryOperator *root : roots) {
+      changed = rewrite(root) or changed;
+    }
+    return changed;
+  }
+
+ private:
+
+  static bool isAssociative(llvm::BinaryOperator *op) {
+    return op->getOpcode() == llvm::Instruction::Add or op->getOpcode() == llvm::Instruction::Mul;
+  }
+
+  /** Operations whose only use is in a tree of the same opcode are flattened into it. */
+  static bool isInterior(llvm::Value *v, unsigned opcode) {
+    llvm::BinaryOperator *op = llvm::dyn_cast<llvm::BinaryOperator>(v);
+    if (op == nullptr or op->getOpcode() != opcode or not op->hasOneUse()) {
+      return false;
+    }
+    llvm::BinaryOperator *user = llvm::dyn_cast<llvm::BinaryOperator>(*op->user_begin());
+    return user != nullptr and user->getOpcode() == opcode;
+  }
+
+  /** x - c is x + (-c), which can be reassociated. */
+  static bool canonicalizeSub(llvm::BinaryOperator *&op) {
+    llvm::ConstantInt *c = llvm::dyn_cast<llvm::ConstantInt>(op->getOperand(1));
+    if (op->getOpcode() != llvm::Instruction::Sub or c == nullptr) {
+      return false;
+    }
+    llvm::BinaryOperator *add = llvm::BinaryOperator::CreateAdd(
+        op->getOperand(0), llvm::ConstantInt::get(c->getType(), -c->getValue()), "", op);
+    add->takeName(op);
+    op->replaceAllUsesWith(add);
+    op->eraseFromParent();
+    op = add;
+    return true;
+  }
+
+  void linearize(llvm::Value *v, unsigned opcode, std::vector<llvm::Value *> &leaves,
+                 std::vector<llvm::Instruction *> &interior) {
+    llvm::BinaryOperator *op = llvm::cast<llvm::BinaryOperator>(v);
+    for (llvm::Value *operand : op->operands()) {
+      if (isInterior(operand, opcode)) {
+        interior.push_back(llvm::cast<llvm::Instruction>(operand));
+        linearize(operand, opcode, leaves, interior);
+      } else {
+        leaves.push_back(operand);
+      }
+    }
+  }
+
+  /** Whether the tree already is the chain of the leaves in the given order. */
+  static bool isChain(llvm::Value *root, std::vector<llvm::Value *> const &leaves, unsigned opcode) {
+    llvm::Value *v = root;
+    for (size_t i = leaves.size() - 1; i != 0; --i) {
+      llvm::BinaryOperator *op = llvm::dyn_cast<llvm::BinaryOperator>(v);
+      if (op == nullptr or op->getOpcode() != opcode or op->getOperand(1) != leaves[i]
+          or (v != root and not isInterior(v, opcode))) {
+        return false;
+      }
+      v = op->getOperand(0);
+    }
+    return v == leaves[0];
+  }
+
+  bool rewrite(llvm::BinaryOperator *root) {
+    unsigned opcode = root->getOpcode();
+    std::vector<llvm::Value *> leaves;
+    std::vector<llvm::Instruction *> interior;
+    linearize(root, opcode, leaves, interior);
+
+    // fold the constants, the identity is left out
+    llvm::APInt folded(root->getType()->getIntegerBitWidth(), opcode == llvm::Instruction::Add ? 0 : 1);
+    std::vector<llvm::Value *> ordered;
+    for (llvm::Value *leaf : leaves) {
+      if (llvm::ConstantInt *c = llvm::dyn_cast<llvm::ConstantInt>(leaf)) {
+        folded = opcode == llvm::Instruction::Add ? folded + c->getValue() : folded * c->getValue();
+      } else {
+        ordered.push_back(leaf);
+      }
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [this](llvm::Value *a, llvm::Value *b) {
+      return rankOf(a) < rankOf(b);
+    });
+    llvm::Constant *constant = llvm::ConstantInt::get(root->getType(), folded);
+    if (opcode == llvm::Instruction::Mul and folded == 0) {
+      ordered.clear();
+    }
+    bool identity = opcode == llvm::Instruction::Add ? folded == 0 : folded == 1;
+    if (not identity or ordered.empty()) {
+      ordered.push_back(constant);
+    }
+
+    if (isChain(root, ordered, opcode)) {
+      return false;
+    }
+    llvm::Value *result = ordered[0];
+    for (size_t i = 1; i != ordered.size(); ++i) {
+      result = llvm::BinaryOperator::Create(static_cast<llvm::Instruction::BinaryOps>(opcode), result, ordered[i], "",
+                                            root);
+    }
+    if (ordered.size() > 1) {
+      result->takeName(root);
+    }
+    root->replaceAllUsesWith(result);
+    root->eraseFromParent();
+    // the interior nodes are only used by each other now
+    for (llvm::Instruction *ins : interior) {
+      ins->replaceAllUsesWith(llvm::UndefValue::get(ins->getType()));
+    }
+    for (llvm::Instruction *ins : interior) {
+      ins->eraseFromParent();
+    }
+    return true;
+  }
+
+  unsigned rankOf(llvm::Value *v) const {
+    auto i = rank_.find(v);
+    // values of unreachable blocks come last
+    return i == rank_.end() ? static_cast<unsigned>(-1) : i->second;
+  }
+
+  llvm::DenseMap<llvm::Value *, unsigned> rank_;
+};
+
+}
+}
+#endif
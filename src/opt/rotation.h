@@ -0,0 +1,172 @@
+#ifndef OPT_ROTATION_H
+#define OPT_ROTATION_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+namespace mila {
+
+namespace rotation {
+
+/** Loop rotation.
+
+    A while loop tests its condition in the header and jumps back to it from the end of the body, so every iteration
+    takes two branches. Rotation copies the header into the preheader, where it guards the loop, and the header is
+    then only entered from the latch and merged into it. The loop becomes a do while loop whose latch is its single
+    exiting block, with one conditional branch per iteration, which is the form scalar evolution counts the trips of
+    and the unroller needs for a runtime remainder. Values of the header used in the loop or after it are merged with
+    their copies by the SSA updater.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic rotated;
+  static llvm::Statistic duplicated;
+
+  /** Instructions, besides phi nodes and the branch, a header may have to be copied. */
+  static constexpr unsigned DUPLICATION_THRESHOLD = 8;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "LoopRotation";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::LoopInfoWrapperPass>();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    llvm::LoopInfo &li = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+    // the loop info is stale once a loop is rotated, so the loops are described up front, inner loops first
+    std::vector<Candidate> candidates;
+    llvm::SmallVector<llvm::Loop *, 4> loops = li.getLoopsInPreorder();
+    for (auto i = loops.rbegin(), e = loops.rend(); i != e; ++i) {
+      Candidate c;
+      if (isCandidate(*i, c)) {
+        candidates.push_back(c);
+      }
+    }
+    for (Candidate const &c : candidates) {
+      rotate(c);
+    }
+    return not candidates.empty();
+  }
+
+ private:
+
+  class Candidate {
+   public:
+    llvm::BasicBlock *header;
+    llvm::BasicBlock *preheader;
+    llvm::BasicBlock *latch;
+    llvm::MDNode *id;
+  };
+
+  static bool isCandidate(llvm::Loop *l, Candidate &c) {
+    if (not l->isLoopSimplifyForm()) {
+      return false;
+    }
+    c.header = l->getHeader();
+    c.preheader = l->getLoopPreheader();
+    c.latch = l->getLoopLatch();
+    c.id = l->getLoopID();
+    // a latch which exits already is a rotated loop
+    llvm::BranchInst *back = llvm::dyn_cast<llvm::BranchInst>(c.latch->getTerminator());
+    llvm::BranchInst *test = llvm::dyn_cast<llvm::BranchInst>(c.header->getTerminator());
+    if (c.latch == c.header or back == nullptr or back->isConditional() or test == nullptr
+        or not test->isConditional() or l->contains(test->getSuccessor(0)) == l->contains(test->getSuccessor(1))) {
+      return false;
+    }
+    unsigned size = 0;
+    for (llvm::Instruction &ins : *c.header) {
+      if (llvm::isa<llvm::AllocaInst>(ins)) {
+        return false;
+      }
+      if (not llvm::isa<llvm::PHINode>(ins) and not ins.isTerminator()) {
+        ++size;
+      }
+    }
+    return size <= DUPLICATION_THRESHOLD;
+  }
+
+  void rotate(Candidate const &c) {
+    llvm::BasicBlock *header = c.header;
+    llvm::BasicBlock *preheader = c.preheader;
+
+    // the guard is the header as seen from the preheader
+    llvm::ValueToValueMapTy vmap;
+    for (auto i = header->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+      vmap[phi] = phi->getIncomingValueForBlock(preheader);
+    }
+    llvm::TerminatorInst *entry = preheader->getTerminator();
+    for (auto i = header->getFirstNonPHI()->getIterator(), e = header->end(); i != e; ++i) {
+      llvm::Instruction *copy = i->clone();
+      copy->setName(i->getName());
+      copy->insertBefore(entry);
+      llvm::RemapInstruction(copy, vmap, llvm::RF_NoModuleLevelChanges | llvm::RF_IgnoreMissingLocals);
+      vmap[&*i] = copy;
+      duplicated += copy->isTerminator() ? 0 : 1;
+    }
+    entry->eraseFromParent();
+    llvm::TerminatorInst *guard = preheader->getTerminator();
+    // the trip count bound describes the exit test of the loop, not the guard
+    guard->setMetadata("mila.trips", nullptr);
+
+    for (llvm::BasicBlock *succ : llvm::successors(guard)) {
+      for (auto i = succ->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+        llvm::Value *v = phi->getIncomingValueForBlock(header);
+        auto mapped = vmap.find(v);
+        phi->addIncoming(mapped == vmap.end() ? v : static_cast<llvm::Value *>(mapped->second), preheader);
+      }
+    }
+    header->removePredecessor(preheader, true);
+
+    // values of the header used outside of it now come from the header or the guard
+    for (llvm::Instruction &ins : *header) {
+      llvm::SmallVector<llvm::Use *, 8> uses;
+      for (llvm::Use &u : ins.uses()) {
+        llvm::Instruction *user = llvm::cast<llvm::Instruction>(u.getUser());
+        llvm::BasicBlock *at = user->getParent();
+        if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(user)) {
+          at = phi->getIncomingBlock(u);
+        }
+        if (at != header and at != preheader) {
+          uses.push_back(&u);
+        }
+      }
+      if (uses.empty()) {
+        continue;
+      }
+      llvm::SSAUpdater ssa;
+      ssa.Initialize(ins.getType(), ins.getName());
+      ssa.AddAvailableValue(header, &ins);
+      ssa.AddAvailableValue(preheader, vmap[&ins]);
+      for (llvm::Use *u : uses) {
+        ssa.RewriteUse(*u);
+      }
+    }
+
+    // the header is the latch now and carries the loop metadata, merging it with the old latch leaves one branch
+    if (c.id != nullptr) {
+      c.latch->getTerminator()->setMetadata(llvm::LLVMContext::MD_loop, nullptr);
+      header->getTerminator()->setMetadata(llvm::LLVMContext::MD_loop, c.id);
+    }
+    llvm::MergeBlockIntoPredecessor(header);
+    ++rotated;
+  }
+};
+
+}
+}
+#endif
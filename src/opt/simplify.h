@@ -0,0 +1,116 @@
+#ifndef OPT_SIMPLIFY_H
+#define OPT_SIMPLIFY_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+
+namespace mila {
+
+namespace simplify {
+
+/** Algebraic simplification.
+
+    Instructions are simplified by LLVM's instruction simplification, which knows the identities like x + 0, x * 1
+    or x - x. On top of that the comparisons the compiler emits for conditions and for boolean operators are
+    simplified: a comparison is turned into an integer by a zero extension and then compared with a constant again,
+    which is either the comparison itself, its inverse or a constant. Users of simplified instructions are visited
+    again until nothing changes.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic identities;
+  static llvm::Statistic compares;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "InstructionSimplification";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.setPreservesCFG();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    bool changed = false;
+    llvm::SimplifyQuery q(f.getParent()->getDataLayout());
+    llvm::SmallSetVector<llvm::Instruction *, 32> worklist;
+    for (llvm::Instruction &ins : llvm::instructions(f)) {
+      worklist.insert(&ins);
+    }
+    while (not worklist.empty()) {
+      llvm::Instruction *ins = worklist.pop_back_val();
+      if (ins->use_empty()) {
+        // dead code is left to dce
+        continue;
+      }
+      llvm::Value *v = nullptr;
+      if (llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(ins)) {
+        v = simplifyCompare(cmp);
+        compares += v != nullptr ? 1 : 0;
+      }
+      if (v == nullptr) {
+        v = llvm::SimplifyInstruction(ins, q);
+        identities += v != nullptr ? 1 : 0;
+      }
+      if (v == nullptr or v == ins) {
+        continue;
+      }
+      for (llvm::User *u : ins->users()) {
+        worklist.insert(llvm::cast<llvm::Instruction>(u));
+      }
+      ins->replaceAllUsesWith(v);
+      if (llvm::isInstructionTriviallyDead(ins)) {
+        worklist.remove(ins);
+        ins->eraseFromParent();
+      }
+      changed = true;
+    }
+    return changed;
+  }
+
+ private:
+
+  /** Compares zext(c) with a constant, which can only be c, not c, or always true or false. */
+  static llvm::Value *simplifyCompare(llvm::ICmpInst *cmp) {
+    llvm::Value *lhs = cmp->getOperand(0);
+    llvm::Value *rhs = cmp->getOperand(1);
+    llvm::CmpInst::Predicate p = cmp->getPredicate();
+    if (llvm::isa<llvm::ConstantInt>(lhs)) {
+      std::swap(lhs, rhs);
+      p = llvm::CmpInst::getSwappedPredicate(p);
+    }
+    llvm::ZExtInst *zext = llvm::dyn_cast<llvm::ZExtInst>(lhs);
+    llvm::ConstantInt *c = llvm::dyn_cast<llvm::ConstantInt>(rhs);
+    if (zext == nullptr or c == nullptr or not zext->getOperand(0)->getType()->isIntegerTy(1)) {
+      return nullptr;
+    }
+    llvm::Value *condition = zext->getOperand(0);
+    bool ifFalse = llvm::ConstantExpr::getICmp(p, llvm::ConstantInt::get(c->getType(), 0), c)->isOneValue();
+    bool ifTrue = llvm::ConstantExpr::getICmp(p, llvm::ConstantInt::get(c->getType(), 1), c)->isOneValue();
+    if (ifFalse == ifTrue) {
+      return llvm::ConstantInt::get(cmp->getType(), ifTrue);
+    }
+    if (ifTrue) {
+      return condition;
+    }
+    // cp and vrp know comparisons, but not xor, so only comparisons are inverted
+    llvm::ICmpInst *inner = llvm::dyn_cast<llvm::ICmpInst>(condition);
+    if (inner == nullptr) {
+      return nullptr;
+    }
+    return new llvm::ICmpInst(cmp, inner->getInversePredicate(), inner->getOperand(0), inner->getOperand(1));
+  }
+};
+
+}
+}
+#endif
@@ -0,0 +1,188 @@
+#ifndef OPT_SPECIALIZATION_H
+#define OPT_SPECIALIZATION_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace specialization {
+
+/** Specializes functions for the constant arguments passed by their call sites.
+
+    Call sites are grouped by the constants they pass. For every group the function is cloned with the constant
+    arguments dropped from its signature and replaced by the constants in the body. The cp analysis then estimates how
+    many instructions of the clone fold away, clones which do not save anything are deleted again. Larger groups are
+    specialized first, as long as the code growth fits the budget. The clones are left to the function pipeline. Every
+    clone is reported as an optimization remark.
+  */
+class Optimization : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  static llvm::Statistic clones;
+  static llvm::Statistic callSites;
+  /** Instructions cp folds or proves unreachable in the clones, times the call sites using them. */
+  static llvm::Statistic savedInstructions;
+
+  /** Largest function which is specialized. */
+  static constexpr unsigned MAX_FUNCTION_SIZE = 200;
+
+  /** Instructions all clones of a module may add. */
+  static constexpr unsigned GROWTH_BUDGET = 400;
+
+  Optimization() :
+      llvm::ModulePass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "FunctionSpecialization";
+  }
+
+  /** Clones and the functions calling them made by the last run. */
+  std::vector<llvm::Function *> const &changed() const {
+    return changed_;
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    changed_.clear();
+    budget_ = GROWTH_BUDGET;
+    std::vector<llvm::Function *> functions;
+    for (llvm::Function &f : m) {
+      if (not f.isDeclaration() and f.arg_size() != 0) {
+        functions.push_back(&f);
+      }
+    }
+    for (llvm::Function *f : functions) {
+      specialize(f);
+    }
+    return not changed_.empty();
+  }
+
+ private:
+
+  typedef std::vector<llvm::Constant *> Key;
+
+  static unsigned size(llvm::Function *f) {
+    unsigned result = 0;
+    for (llvm::BasicBlock &b : *f) {
+      result += b.size();
+    }
+    return result;
+  }
+
+  void specialize(llvm::Function *f) {
+    unsigned s = size(f);
+    if (s > MAX_FUNCTION_SIZE) {
+      return;
+    }
+
+    std::map<Key, std::vector<llvm::CallInst *>> groups;
+    for (llvm::User *u : f->users()) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(u);
+      if (call == nullptr or call->getCalledFunction() != f) {
+        continue;
+      }
+      Key key;
+      bool constant = false;
+      for (llvm::Value *arg : call->arg_operands()) {
+        key.push_back(llvm::dyn_cast<llvm::ConstantInt>(arg));
+        constant = constant or key.back() != nullptr;
+      }
+      if (constant) {
+        groups[key].push_back(call);
+      }
+    }
+
+    std::vector<std::pair<Key, std::vector<llvm::CallInst *>>> ordered(groups.begin(), groups.end());
+    std::stable_sort(ordered.begin(), ordered.end(), [](std::pair<Key, std::vector<llvm::CallInst *>> const &a,
+                                                        std::pair<Key, std::vector<llvm::CallInst *>> const &b) {
+      return a.second.size() > b.second.size();
+    });
+
+    unsigned index = 0;
+    for (auto const &group : ordered) {
+      if (s > budget_) {
+        break;
+      }
+      llvm::ValueToValueMapTy vmap;
+      for (llvm::Argument &arg : f->args()) {
+        if (group.first[arg.getArgNo()] != nullptr) {
+          vmap[&arg] = group.first[arg.getArgNo()];
+        }
+      }
+      llvm::Function *clone = llvm::CloneFunction(f, vmap);
+      unsigned savings = estimateSavings(clone) * group.second.size();
+      if (savings == 0) {
+        clone->eraseFromParent();
+        continue;
+      }
+      clone->setName(f->getName() + "." + std::to_string(++index));
+      clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+      budget_ -= s;
+
+      for (llvm::CallInst *call : group.second) {
+        llvm::SmallVector<llvm::Value *, 4> args;
+        for (unsigned i = 0, e = call->getNumArgOperands(); i != e; ++i) {
+          if (group.first[i] == nullptr) {
+            args.push_back(call->getArgOperand(i));
+          }
+        }
+        llvm::CallInst *replacement = llvm::CallInst::Create(clone, args, "", call);
+        replacement->takeName(call);
+        call->replaceAllUsesWith(replacement);
+        changed_.push_back(call->getFunction());
+        call->eraseFromParent();
+      }
+      changed_.push_back(clone);
+      ++clones;
+      callSites += group.second.size();
+      savedInstructions += savings;
+      llvm::OptimizationRemarkEmitter ore(f);
+      ore.emit(llvm::OptimizationRemark(REMARKS, "Specialized", f)
+                   << "specialized " << llvm::ore::NV("Function", f) << " as " << llvm::ore::NV("Clone", clone)
+                   << " for " << llvm::ore::NV("CallSites", static_cast<unsigned>(group.second.size()))
+                   << " call sites, saving " << llvm::ore::NV("Savings", savings) << " instructions");
+    }
+  }
+
+  /** Counts the instructions of the clone cp can prove constant or unreachable, and the branches it can fold. */
+  static unsigned estimateSavings(llvm::Function *clone) {
+    cp::Analysis a;
+    a.solve(*clone, nullptr);
+    unsigned result = 0;
+    for (llvm::BasicBlock &b : *clone) {
+      if (not a.isExecutable(&b)) {
+        result += b.size();
+        continue;
+      }
+      for (llvm::Instruction &ins : b) {
+        if (llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(&ins)) {
+          AValue cond = br->isConditional() ? a.value(br->getCondition()) : AValue();
+          result += cond.isConst() or cond == AValue::Type::NonZero ? 1 : 0;
+        } else if (not ins.getType()->isVoidTy() and not ins.mayHaveSideEffects() and a.value(&ins).isConst()) {
+          ++result;
+        }
+      }
+    }
+    return result;
+  }
+
+  static constexpr const char *REMARKS = "mila-specialize";
+
+  unsigned budget_ = GROWTH_BUDGET;
+  std::vector<llvm::Function *> changed_;
+};
+
+}
+}
+#endif
@@ -0,0 +1,186 @@
+#ifndef OPT_THREADING_H
+#define OPT_THREADING_H
+
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace threading {
+
+/** Jump threading through join blocks.
+
+    An if statement ends in a join block whose phi node merges the values of the two branches, and when the next
+    condition tests that value the branch in the join is decided by the edge it was entered through. For every small
+    block ending in a conditional branch on its phi nodes, each predecessor gets a copy of the block with the phi nodes
+    replaced by the values coming from it. If the condition of the simplified copy is constant, the predecessor jumps
+    to the copy, which jumps straight to the decided successor. Values of the block used elsewhere are merged with
+    their copies by the SSA updater. Loop headers are neither threaded through nor threaded to, that could turn loops
+    into irreducible ones.
+  */
+class Optimization : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  static llvm::Statistic threaded;
+  static llvm::Statistic duplicated;
+
+  /** Instructions, besides phi nodes and the branch, a block may have to be copied. */
+  static constexpr unsigned DUPLICATION_THRESHOLD = 6;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "JumpThreading";
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    headers_.clear();
+    llvm::SmallVector<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>, 8> backedges;
+    llvm::FindFunctionBackedges(f, backedges);
+    for (auto const &edge : backedges) {
+      headers_.insert(edge.second);
+    }
+
+    bool changed = false;
+    std::vector<llvm::BasicBlock *> blocks;
+    for (llvm::BasicBlock &b : f) {
+      blocks.push_back(&b);
+    }
+    for (llvm::BasicBlock *b : blocks) {
+      if (not isCandidate(b)) {
+        continue;
+      }
+      llvm::SmallSetVector<llvm::BasicBlock *, 4> preds(llvm::pred_begin(b), llvm::pred_end(b));
+      for (llvm::BasicBlock *pred : preds) {
+        changed = thread(pred, b) or changed;
+      }
+    }
+    return cp::Optimization::removeUnreachableBlocks(f) or changed;
+  }
+
+ private:
+
+  bool isCandidate(llvm::BasicBlock *b) {
+    llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(b->getTerminator());
+    if (br == nullptr or not br->isConditional() or br->getSuccessor(0) == br->getSuccessor(1) or headers_.count(b)
+        or not llvm::isa<llvm::PHINode>(b->front())) {
+      return false;
+    }
+    unsigned size = 0;
+    for (llvm::Instruction &ins : *b) {
+      if (llvm::isa<llvm::AllocaInst>(ins)) {
+        return false;
+      }
+      if (not llvm::isa<llvm::PHINode>(ins) and not ins.isTerminator()) {
+        ++size;
+      }
+    }
+    return size <= DUPLICATION_THRESHOLD;
+  }
+
+  static unsigned edges(llvm::BasicBlock *from, llvm::BasicBlock *to) {
+    unsigned result = 0;
+    for (llvm::BasicBlock *succ : llvm::successors(from)) {
+      result += succ == to ? 1 : 0;
+    }
+    return result;
+  }
+
+  bool thread(llvm::BasicBlock *pred, llvm::BasicBlock *b) {
+    if (not llvm::isa<llvm::BranchInst>(pred->getTerminator()) or edges(pred, b) != 1) {
+      return false;
+    }
+    llvm::Function *f = b->getParent();
+    llvm::SimplifyQuery q(f->getParent()->getDataLayout());
+
+    // copy the block as seen from the predecessor, simplifying on the way
+    llvm::ValueToValueMapTy vmap;
+    for (auto i = b->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+      vmap[phi] = phi->getIncomingValueForBlock(pred);
+    }
+    llvm::BasicBlock *copy = llvm::BasicBlock::Create(f->getContext(), b->getName() + ".thread", f, b);
+    unsigned copied = 0;
+    for (auto i = b->getFirstNonPHI()->getIterator(), e = b->end(); i != e; ++i) {
+      llvm::Instruction *c = i->clone();
+      c->setName(i->getName());
+      copy->getInstList().push_back(c);
+      llvm::RemapInstruction(c, vmap, llvm::RF_NoModuleLevelChanges | llvm::RF_IgnoreMissingLocals);
+      vmap[&*i] = c;
+      if (llvm::Value *v = llvm::SimplifyInstruction(c, q)) {
+        vmap[&*i] = v;
+        if (not c->mayHaveSideEffects()) {
+          c->eraseFromParent();
+          continue;
+        }
+      }
+      copied += c->isTerminator() ? 0 : 1;
+    }
+
+    llvm::BranchInst *br = llvm::cast<llvm::BranchInst>(copy->getTerminator());
+    llvm::ConstantInt *cond = llvm::dyn_cast<llvm::ConstantInt>(br->getCondition());
+    llvm::BasicBlock *succ = cond == nullptr ? nullptr : br->getSuccessor(cond->isZero() ? 1 : 0);
+    if (succ == nullptr or headers_.count(succ)) {
+      for (llvm::Instruction &ins : *copy) {
+        ins.dropAllReferences();
+      }
+      copy->eraseFromParent();
+      return false;
+    }
+    llvm::BranchInst::Create(succ, br);
+    br->eraseFromParent();
+
+    for (auto i = succ->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+      llvm::Value *v = phi->getIncomingValueForBlock(b);
+      auto mapped = vmap.find(v);
+      phi->addIncoming(mapped == vmap.end() ? v : static_cast<llvm::Value *>(mapped->second), copy);
+    }
+    pred->getTerminator()->replaceUsesOfWith(b, copy);
+    b->removePredecessor(pred, true);
+
+    // values of the block used outside of it now come from the block or its copy
+    for (llvm::Instruction &ins : *b) {
+      llvm::SmallVector<llvm::Use *, 8> uses;
+      for (llvm::Use &u : ins.uses()) {
+        llvm::Instruction *user = llvm::cast<llvm::Instruction>(u.getUser());
+        llvm::BasicBlock *at = user->getParent();
+        if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(user)) {
+          at = phi->getIncomingBlock(u);
+        }
+        if (at != b and at != copy) {
+          uses.push_back(&u);
+        }
+      }
+      if (uses.empty()) {
+        continue;
+      }
+      llvm::SSAUpdater ssa;
+      ssa.Initialize(ins.getType(), ins.getName());
+      ssa.AddAvailableValue(b, &ins);
+      ssa.AddAvailableValue(copy, vmap[&ins]);
+      for (llvm::Use *u : uses) {
+        ssa.RewriteUse(*u);
+      }
+    }
+
+    ++threaded;
+    duplicated += copied;
+    return true;
+  }
+
+  llvm::SmallPtrSet<llvm::BasicBlock const *, 8> headers_;
+};
+
+}
+}
+#endif
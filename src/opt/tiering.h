@@ -0,0 +1,305 @@
+#ifndef OPT_TIERING_H
+#define OPT_TIERING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "runtime.h"
+#include "cp.h"
+
+namespace mila {
+
+namespace tiering {
+
+/** Instrumentation of the baseline of tiered code.
+
+    Every function but main gets a record in the runtime, counts its calls in it and reports itself to tier_hot_ on
+    the call which reaches the threshold. Calls of the functions load the address of the callee from its record
+    instead of calling it directly, so that the JIT switches all callers to the optimized code by storing its address.
+    The address is stored by the background compilation while the program runs, the load acquires what the store
+    releases so that the code it points to is visible to the caller.
+  */
+class Instrumentation : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  static llvm::Statistic loops;
+  static llvm::Statistic becameHot;
+  static llvm::Statistic switched;
+  static llvm::Statistic microseconds;
+
+  explicit Instrumentation(unsigned threshold) :
+      llvm::ModulePass(ID),
+      threshold_(threshold) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "TieringInstrumentation";
+  }
+
+  bool runOnModule(llvm::Module &m) override {
+    functions_.clear();
+    for (llvm::Function &f : m) {
+      if (not f.isDeclaration() and f.getName() != "main") {
+        functions_[f.getName().str()] = tier::function(f.getName().str());
+      }
+    }
+    if (functions_.empty()) {
+      return false;
+    }
+
+    std::vector<llvm::CallInst *> calls;
+    for (llvm::Function &f : m) {
+      for (llvm::Instruction &ins : llvm::instructions(f)) {
+        llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&ins);
+        if (call != nullptr and call->getCalledFunction() != nullptr
+            and functions_.count(call->getCalledFunction()->getName().str())) {
+          calls.push_back(call);
+        }
+      }
+    }
+    for (llvm::CallInst *call : calls) {
+      redirect(call, tier::get(functions_[call->getCalledFunction()->getName().str()]));
+    }
+
+    llvm::Function *hot = runtime(m);
+    for (auto const &f : functions_) {
+      count(*m.getFunction(f.first), f.second, hot);
+    }
+    return true;
+  }
+
+  /** Indices of the records of the instrumented functions by their names. */
+  std::map<std::string, int> const &functions() const {
+    return functions_;
+  }
+
+  /** Declares tier_hot_. */
+  static llvm::Function *runtime(llvm::Module &m) {
+    llvm::Function *result = m.getFunction("tier_hot_");
+    if (result == nullptr) {
+      llvm::LLVMContext &c = m.getContext();
+      result = llvm::Function::Create(
+          llvm::FunctionType::get(llvm::Type::getVoidTy(c), {llvm::Type::getInt32Ty(c)}, false),
+          llvm::GlobalValue::ExternalLinkage, "tier_hot_", &m);
+      result->setCallingConv(llvm::CallingConv::C);
+    }
+    return result;
+  }
+
+  static llvm::Value *address(llvm::IRBuilder<> &b, void const *at, llvm::Type *type) {
+    return b.CreateIntToPtr(b.getInt64(reinterpret_cast<uintptr_t>(at)), type->getPointerTo());
+  }
+
+ private:
+
+  void count(llvm::Function &f, int index, llvm::Function *hot) {
+    // after the variables of the entry block
+    llvm::BasicBlock &entry = f.getEntryBlock();
+    auto ip = entry.getFirstInsertionPt();
+    while (llvm::isa<llvm::AllocaInst>(*ip)) {
+      ++ip;
+    }
+    llvm::IRBuilder<> b(&entry, ip);
+    llvm::Value *counter = address(b, &tier::get(index).calls, b.getInt64Ty());
+    llvm::Value *calls = b.CreateAdd(b.CreateLoad(counter), b.getInt64(1));
+    b.CreateStore(calls, counter);
+    llvm::TerminatorInst *then = llvm::SplitBlockAndInsertIfThen(
+        b.CreateICmpEQ(calls, b.getInt64(threshold_)), &*ip, false,
+        llvm::MDBuilder(f.getContext()).createBranchWeights(1, threshold_));
+    llvm::CallInst::Create(hot, {b.getInt32(index)}, "", then);
+  }
+
+  static void redirect(llvm::CallInst *call, tier::Function &record) {
+    llvm::Function *callee = call->getCalledFunction();
+    llvm::IRBuilder<> b(call);
+    llvm::LoadInst *code = b.CreateLoad(address(b, &record.code, callee->getType()), callee->getName() + ".code");
+    code->setAtomic(llvm::AtomicOrdering::Acquire);
+    code->setAlignment(alignof(void *));
+    call->setCalledFunction(code);
+  }
+
+  unsigned threshold_;
+
+  std::map<std::string, int> functions_;
+};
+
+/** On-stack replacement of the loops of main in the baseline of tiered code.
+
+    Main runs only once, a program spending its time in a loop of main would never leave the baseline otherwise. The
+    header of every loop of main gets a record like a function, counts the iterations in it and reports the loop to
+    tier_hot_ when they reach the threshold. From then on every iteration checks whether the optimized code of the
+    loop is ready, the continuation of main from its header, which takes the values of the variables of main. Once
+    it is, main passes its variables to the continuation and returns what it returns. The globals are shared by both
+    tiers, only the locals are passed. A main which has variables outside of its entry block or keeps values in
+    registers from one block to another is left alone, its continuation could not recreate them.
+  */
+class OnStackReplacement : public llvm::FunctionPass {
+ public:
+  static char ID;
+
+  /** A loop of main, the index of its header block and of its record. */
+  class Entry {
+   public:
+    unsigned header;
+    int record;
+  };
+
+  explicit OnStackReplacement(unsigned threshold) :
+      llvm::FunctionPass(ID),
+      threshold_(threshold) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "OnStackReplacement";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<llvm::LoopInfoWrapperPass>();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    entries_.clear();
+    std::vector<llvm::AllocaInst *> vars;
+    if (f.getName() != "main" or not variables(f, vars)) {
+      return false;
+    }
+    // the headers are numbered before any block is added
+    std::vector<llvm::BasicBlock *> blocks;
+    for (llvm::BasicBlock &b : f) {
+      blocks.push_back(&b);
+    }
+    llvm::LoopInfo &li = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+    for (llvm::Loop *l : li.getLoopsInPreorder()) {
+      unsigned header = std::find(blocks.begin(), blocks.end(), l->getHeader()) - blocks.begin();
+      entries_.push_back(Entry{header, tier::function(continuationName(header))});
+    }
+    for (Entry const &e : entries_) {
+      instrument(blocks[e.header], e.record, vars);
+      ++Instrumentation::loops;
+    }
+    return not entries_.empty();
+  }
+
+  /** The instrumented loops. */
+  std::vector<Entry> const &entries() const {
+    return entries_;
+  }
+
+  /** Adds the continuation of main from the header with the given index to the module of main. */
+  static void continuation(llvm::Function *main, unsigned header) {
+    std::vector<llvm::AllocaInst *> vars;
+    variables(*main, vars);
+    std::vector<llvm::Type *> types;
+    for (llvm::AllocaInst *v : vars) {
+      types.push_back(v->getAllocatedType());
+    }
+    llvm::Function *result = llvm::Function::Create(
+        llvm::FunctionType::get(main->getReturnType(), types, false), llvm::GlobalValue::ExternalLinkage,
+        continuationName(header), main->getParent());
+    llvm::ValueToValueMapTy vmap;
+    llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+    llvm::CloneFunctionInto(result, main, vmap, false, returns);
+
+    // the variables start with the values passed in, and the code at the header, the rest of the entry is gone
+    llvm::BasicBlock *from = llvm::cast<llvm::BasicBlock>(vmap[&*std::next(main->begin(), header)]);
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(main->getContext(), "osr.entry", result, &result->front());
+    llvm::IRBuilder<> b(entry);
+    auto arg = result->arg_begin();
+    for (llvm::AllocaInst *v : vars) {
+      llvm::AllocaInst *copy = llvm::cast<llvm::AllocaInst>(vmap[v]);
+      copy->removeFromParent();
+      b.Insert(copy);
+      arg->setName(v->getName());
+      b.CreateStore(&*arg++, copy);
+    }
+    b.CreateBr(from);
+    cp::Optimization::removeUnreachableBlocks(*result);
+  }
+
+ private:
+
+  static std::string continuationName(unsigned header) {
+    return STR("main.osr." << header);
+  }
+
+  /** The variables of the function in order, false if it is no candidate. */
+  static bool variables(llvm::Function &f, std::vector<llvm::AllocaInst *> &result) {
+    for (llvm::BasicBlock &b : f) {
+      for (llvm::Instruction &ins : b) {
+        if (llvm::AllocaInst *v = llvm::dyn_cast<llvm::AllocaInst>(&ins)) {
+          if (&b != &f.getEntryBlock()) {
+            return false;
+          }
+          result.push_back(v);
+        } else if (ins.isUsedOutsideOfBlock(&b)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /** Counts the iterations at the header and enters the continuation once it is ready. */
+  void instrument(llvm::BasicBlock *header, int record, std::vector<llvm::AllocaInst *> const &vars) {
+    llvm::Function *f = header->getParent();
+    llvm::LLVMContext &c = f->getContext();
+    tier::Function &r = tier::get(record);
+    llvm::BasicBlock *rest = header->splitBasicBlock(header->getFirstInsertionPt(), header->getName() + ".rest");
+    llvm::BasicBlock *check = llvm::BasicBlock::Create(c, "osr.check", f, rest);
+    llvm::BasicBlock *report = llvm::BasicBlock::Create(c, "osr.report", f, rest);
+    llvm::BasicBlock *poll = llvm::BasicBlock::Create(c, "osr.poll", f, rest);
+    llvm::BasicBlock *enter = llvm::BasicBlock::Create(c, "osr.enter", f, rest);
+    llvm::MDBuilder md(c);
+
+    header->getTerminator()->eraseFromParent();
+    llvm::IRBuilder<> b(header);
+    llvm::Value *counter = Instrumentation::address(b, &r.calls, b.getInt64Ty());
+    llvm::Value *iterations = b.CreateAdd(b.CreateLoad(counter), b.getInt64(1));
+    b.CreateStore(iterations, counter);
+    b.CreateCondBr(b.CreateICmpUGE(iterations, b.getInt64(threshold_)), check, rest,
+                   md.createBranchWeights(1, threshold_));
+
+    b.SetInsertPoint(check);
+    b.CreateCondBr(b.CreateICmpEQ(iterations, b.getInt64(threshold_)), report, poll);
+
+    b.SetInsertPoint(report);
+    b.CreateCall(Instrumentation::runtime(*f->getParent()), {b.getInt32(record)});
+    b.CreateBr(poll);
+
+    std::vector<llvm::Type *> types;
+    for (llvm::AllocaInst *v : vars) {
+      types.push_back(v->getAllocatedType());
+    }
+    llvm::PointerType *type = llvm::FunctionType::get(f->getReturnType(), types, false)->getPointerTo();
+    b.SetInsertPoint(poll);
+    llvm::LoadInst *code = b.CreateLoad(Instrumentation::address(b, &r.code, type), "osr.code");
+    code->setAtomic(llvm::AtomicOrdering::Acquire);
+    code->setAlignment(alignof(void *));
+    b.CreateCondBr(b.CreateICmpNE(code, llvm::ConstantPointerNull::get(type)), enter, rest);
+
+    b.SetInsertPoint(enter);
+    std::vector<llvm::Value *> values;
+    for (llvm::AllocaInst *v : vars) {
+      values.push_back(b.CreateLoad(v));
+    }
+    b.CreateRet(b.CreateCall(code, values));
+  }
+
+  unsigned threshold_;
+
+  std::vector<Entry> entries_;
+};
+
+}
+}
+#endif
@@ -1,7 +1,10 @@
 #ifndef OPT_LOOP_UNROLLING_H
 #define OPT_LOOP_UNROLLING_H
 
+#include <algorithm>
+
 #include "mila.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/Transforms/Utils/UnrollLoop.h"
@@ -9,20 +12,40 @@
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Analysis/OptimizationRemarkEmitter.h"
-#include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm.h"
-#include <iostream>
+#include "vrp.h"
 
 namespace mila {
 
 namespace unrolling {
 
-class Optimization : public llvm::LoopPass {
+/** Loop unrolling driven by a body size cost model.
+
+    Every loop is visited once, inner loops before the loops containing them. Loops with a constant trip count are
+    unrolled fully if the unrolled code fits the size budget, other loops are unrolled partially by the largest power
+    of two factor whose copies fit the partial budget. Loops whose trip count is only known at runtime get a remainder
+    loop for the iterations left over. With a profile, loops which never ran are left alone and the partial factor
+    does not exceed the average number of iterations. Partially unrolled loops are marked so that a repeated pipeline
+    does not unroll them again. The decisions are reported as optimization remarks.
+  */
+class Optimization : public llvm::FunctionPass {
  public:
   static char ID;
 
+  /** Instructions the fully unrolled loop may have. */
+  static constexpr unsigned FULL_UNROLL_BUDGET = 256;
+
+  /** Instructions the body of a partially unrolled loop may have. */
+  static constexpr unsigned PARTIAL_UNROLL_BUDGET = 64;
+
+  static constexpr unsigned MAX_UNROLL_FACTOR = 8;
+
+  static llvm::Statistic full;
+  static llvm::Statistic partial;
+
   Optimization():
-      llvm::LoopPass(ID) {
+      llvm::FunctionPass(ID) {
   }
 
   llvm::StringRef getPassName() const override {
@@ -36,9 +59,8 @@ class Optimization : public llvm::LoopPass {
     AU.addRequired<llvm::AssumptionCacheTracker>();
   }
 
-  bool runOnLoop(llvm::Loop *L, llvm::LPPassManager &LPM) override {
+  bool runOnFunction(llvm::Function &F) override {
     bool modified = false;
-    llvm::Function &F = *L->getHeader()->getParent();
 
     auto &LI = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
     auto &SE = getAnalysis<llvm::ScalarEvolutionWrapperPass>().getSE();
@@ -46,31 +68,150 @@ class Optimization : public llvm::LoopPass {
     auto &AC = getAnalysis<llvm::AssumptionCacheTracker>().getAssumptionCache(F);
     llvm::OptimizationRemarkEmitter ORE(&F);
 
-    for(auto i : LI) {
-      auto loop = &*i;
-      auto tripCount = SE.getSmallConstantTripCount(loop);
-      auto tripMultiple = SE.getSmallConstantTripMultiple(loop);
-      auto result = llvm::UnrollLoop(
-              loop, 2,
-              tripCount,
-              false, true, true, false, false,
-              tripMultiple, 0, true,
-              &LI, &SE, &DT, &AC, &ORE,
-              true);
-      if (result != llvm::LoopUnrollResult::Unmodified) {
-        modified = true;
+    // reversed preorder visits the inner loops first, loops created by the unroller are not revisited
+    llvm::SmallVector<llvm::Loop *, 4> loops = LI.getLoopsInPreorder();
+    for (auto i = loops.rbegin(), e = loops.rend(); i != e; ++i) {
+      modified = unroll(*i, LI, SE, DT, AC, ORE) or modified;
+    }
+    return modified;
+  }
+
+ private:
+
+  /** Size of the loop body in instructions, phis and branches are free as they mostly disappear in the copies. */
+  static unsigned loopSize(llvm::Loop *L) {
+    unsigned size = 0;
+    for (llvm::BasicBlock *b : L->blocks()) {
+      for (llvm::Instruction &ins : *b) {
+        if (not llvm::isa<llvm::PHINode>(ins) and not llvm::isa<llvm::BranchInst>(ins)) {
+          ++size;
+        }
+      }
+    }
+    return size;
+  }
+
+  bool unroll(llvm::Loop *L,
+              llvm::LoopInfo &LI,
+              llvm::ScalarEvolution &SE,
+              llvm::DominatorTree &DT,
+              llvm::AssumptionCache &AC,
+              llvm::OptimizationRemarkEmitter &ORE) {
+    llvm::BasicBlock *header = L->getHeader();
+    if (not L->isLoopSimplifyForm() or L->getExitingBlock() == nullptr) {
+      ORE.emit(llvm::OptimizationRemarkMissed(REMARKS, "Unsupported", L->getStartLoc(), header)
+                   << "loop is not in simplified form or has multiple exits");
+      return false;
+    }
+
+    // remainder loops and partially unrolled loops are marked, unrolling them again when the pipeline repeats gains
+    // nothing
+    if (llvm::GetUnrollMetadata(L->getLoopID(), "llvm.loop.unroll.disable") != nullptr) {
+      ORE.emit(llvm::OptimizationRemarkMissed(REMARKS, "Disabled", L->getStartLoc(), header)
+                   << "loop is marked as not to be unrolled");
+      return false;
+    }
+
+    // the branch weights of the exit tell how often the loop ran and how many iterations it took on average
+    unsigned expectedTrips = 0;
+    llvm::BranchInst *exit = llvm::dyn_cast<llvm::BranchInst>(L->getExitingBlock()->getTerminator());
+    uint64_t taken;
+    uint64_t notTaken;
+    if (exit != nullptr and exit->extractProfMetadata(taken, notTaken)) {
+      uint64_t exits = L->contains(exit->getSuccessor(0)) ? notTaken : taken;
+      if (taken + notTaken == 0) {
+        ORE.emit(llvm::OptimizationRemarkMissed(REMARKS, "Cold", L->getStartLoc(), header)
+                     << "loop never ran when the profile was collected");
+        return false;
+      }
+      if (exits != 0) {
+        expectedTrips = static_cast<unsigned>(std::min<uint64_t>((taken + notTaken) / exits, MAX_UNROLL_FACTOR));
       }
     }
 
-    if (modified) {
-      std::cout << "Works!" << std::endl;
+    unsigned tripCount = SE.getSmallConstantTripCount(L);
+    unsigned tripMultiple = SE.getSmallConstantTripMultiple(L);
+    // value ranges bound the number of exit tests even when scalar evolution cannot count them, there is
+    // nothing to gain from unrolling a body which runs at most once
+    unsigned maxTrips = vrp::Optimization::maxTripCount(L);
+    if (maxTrips != 0 and maxTrips <= 2) {
+      ORE.emit(llvm::OptimizationRemarkMissed(REMARKS, "TooFewIterations", L->getStartLoc(), header)
+                   << "loop runs at most " << llvm::ore::NV("MaxTripCount", maxTrips) << " times");
+      return false;
+    }
+
+    unsigned size = std::max(loopSize(L), 1u);
+    unsigned count;
+    if (tripCount != 0 and tripCount * size <= FULL_UNROLL_BUDGET) {
+      count = tripCount;
     } else {
-      std::cout << "Nope" << std::endl;
+      count = 1;
+      while (count * 2 <= MAX_UNROLL_FACTOR and count * 2 * size <= PARTIAL_UNROLL_BUDGET
+          and (maxTrips == 0 or count * 2 <= maxTrips) and (expectedTrips == 0 or count * 2 <= expectedTrips)) {
+        count *= 2;
+      }
+      // with a known trip count the copies only need the exit test if the factor does not divide it
+      while (tripCount != 0 and tripCount % count != 0) {
+        count /= 2;
+      }
+    }
+    if (count < 2) {
+      ORE.emit(llvm::OptimizationRemarkMissed(REMARKS, "TooLarge", L->getStartLoc(), header)
+                   << "loop body of " << llvm::ore::NV("Size", size) << " instructions is too large to unroll");
+      return false;
     }
 
-    return modified;
+    // the bound describes the loop as it is now, the copies would only inherit a stale one
+    for (llvm::BasicBlock *b : L->blocks()) {
+      b->getTerminator()->setMetadata("mila.trips", nullptr);
+    }
+    llvm::formLCSSARecursively(*L, DT, &LI, &SE);
+    llvm::DebugLoc loc = L->getStartLoc();
+    llvm::LoopUnrollResult result = llvm::UnrollLoop(
+        L, count, tripCount,
+        false, tripCount == 0, false, false, false,
+        tripMultiple, 0, false,
+        &LI, &SE, &DT, &AC, &ORE,
+        true);
+    // the loop may be gone now, only the values saved above can be used
+    switch (result) {
+      case llvm::LoopUnrollResult::FullyUnrolled:
+        ++full;
+        ORE.emit(llvm::OptimizationRemark(REMARKS, "FullyUnrolled", loc, header)
+                     << "fully unrolled loop with " << llvm::ore::NV("TripCount", tripCount) << " iterations");
+        return true;
+      case llvm::LoopUnrollResult::PartiallyUnrolled:
+        ++partial;
+        disableUnrolling(L);
+        ORE.emit(llvm::OptimizationRemark(REMARKS, "PartiallyUnrolled", loc, header)
+                     << "unrolled loop by a factor of " << llvm::ore::NV("UnrollCount", count)
+                     << (tripCount == 0 ? " with a runtime remainder" : ""));
+        return true;
+      default:
+        ORE.emit(llvm::OptimizationRemarkMissed(REMARKS, "NotUnrolled", loc, header)
+                     << "unable to unroll loop by a factor of " << llvm::ore::NV("UnrollCount", count));
+        return false;
+    }
+  }
+
+  /** Adds llvm.loop.unroll.disable to the loop id of the loop, keeping the hints it already has. */
+  static void disableUnrolling(llvm::Loop *L) {
+    llvm::LLVMContext &ctx = L->getHeader()->getContext();
+    llvm::SmallVector<llvm::Metadata *, 4> ops;
+    // the first operand of a loop id refers to the id itself
+    ops.push_back(nullptr);
+    if (llvm::MDNode *id = L->getLoopID()) {
+      for (unsigned i = 1, e = id->getNumOperands(); i != e; ++i) {
+        ops.push_back(id->getOperand(i));
+      }
+    }
+    ops.push_back(llvm::MDNode::get(ctx, llvm::MDString::get(ctx, "llvm.loop.unroll.disable")));
+    llvm::MDNode *id = llvm::MDNode::getDistinct(ctx, ops);
+    id->replaceOperandWith(0, id);
+    L->setLoopID(id);
   }
 
+  static constexpr const char *REMARKS = "mila-unroll";
 };
 
 }
@@ -0,0 +1,958 @@
+#ifndef OPT_VALUE_RANGE_H
+#define OPT_VALUE_RANGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "cp.h"
+#include "worklist.h"
+
+namespace mila {
+
+/** Signed interval [lo, hi] of 32bit values. The empty range means nothing is known about the value yet, or that
+    the code computing it cannot execute.
+  */
+class Range {
+ public:
+
+  Range() :
+      lo_(1),
+      hi_(0) {
+  }
+
+  Range(int64_t lo, int64_t hi) :
+      lo_(lo),
+      hi_(hi) {
+  }
+
+  static Range constant(int64_t value) {
+    return Range(value, value);
+  }
+
+  static Range full() {
+    return Range(minValue(), maxValue());
+  }
+
+  static int64_t minValue() {
+    return std::numeric_limits<int32_t>::min();
+  }
+
+  static int64_t maxValue() {
+    return std::numeric_limits<int32_t>::max();
+  }
+
+  int64_t lo() const {
+    assert(not isEmpty());
+    return lo_;
+  }
+
+  int64_t hi() const {
+    assert(not isEmpty());
+    return hi_;
+  }
+
+  bool isEmpty() const {
+    return lo_ > hi_;
+  }
+
+  bool isFull() const {
+    return lo_ == minValue() and hi_ == maxValue();
+  }
+
+  bool isConst() const {
+    return lo_ == hi_;
+  }
+
+  bool contains(int64_t value) const {
+    return lo_ <= value and value <= hi_;
+  }
+
+  /** Smallest range containing both ranges. */
+  Range join(Range const &other) const {
+    if (isEmpty()) {
+      return other;
+    }
+    if (other.isEmpty()) {
+      return *this;
+    }
+    return Range(std::min(lo_, other.lo_), std::max(hi_, other.hi_));
+  }
+
+  /** Intersection of the ranges. */
+  Range meet(Range const &other) const {
+    if (isEmpty() or other.isEmpty()) {
+      return Range();
+    }
+    return Range(std::max(lo_, other.lo_), std::min(hi_, other.hi_));
+  }
+
+  /** Joins the next iterate with this one, jumping straight to the type's bounds in every direction it grew. */
+  Range widen(Range const &next) const {
+    if (isEmpty() or next.isEmpty()) {
+      return join(next);
+    }
+    return Range(next.lo_ < lo_ ? minValue() : lo_, next.hi_ > hi_ ? maxValue() : hi_);
+  }
+
+  bool operator==(Range const &other) const {
+    if (isEmpty() or other.isEmpty()) {
+      return isEmpty() and other.isEmpty();
+    }
+    return lo_ == other.lo_ and hi_ == other.hi_;
+  }
+
+  bool operator!=(Range const &other) const {
+    return not (*this == other);
+  }
+
+  static Range add(Range const &a, Range const &b) {
+    if (a.isEmpty() or b.isEmpty()) {
+      return Range();
+    }
+    return wrap(a.lo_ + b.lo_, a.hi_ + b.hi_);
+  }
+
+  static Range sub(Range const &a, Range const &b) {
+    if (a.isEmpty() or b.isEmpty()) {
+      return Range();
+    }
+    return wrap(a.lo_ - b.hi_, a.hi_ - b.lo_);
+  }
+
+  static Range mul(Range const &a, Range const &b) {
+    if (a.isEmpty() or b.isEmpty()) {
+      return Range();
+    }
+    int64_t c[] = {a.lo_ * b.lo_, a.lo_ * b.hi_, a.hi_ * b.lo_, a.hi_ * b.hi_};
+    return wrap(*std::min_element(c, c + 4), *std::max_element(c, c + 4));
+  }
+
+  static Range sdiv(Range const &a, Range const &b) {
+    if (a.isEmpty() or b.isEmpty()) {
+      return Range();
+    }
+    // division by zero is undefined, only the non-zero parts of the divisor matter
+    if (b.contains(0)) {
+      Range negative = b.meet(Range(minValue(), -1));
+      Range positive = b.meet(Range(1, maxValue()));
+      if (negative.isEmpty() and positive.isEmpty()) {
+        return full();
+      }
+      return sdiv(a, negative).join(sdiv(a, positive));
+    }
+    // with the sign of the divisor fixed, the quotient is monotonic in both operands
+    int64_t c[] = {a.lo_ / b.lo_, a.lo_ / b.hi_, a.hi_ / b.lo_, a.hi_ / b.hi_};
+    return wrap(*std::min_element(c, c + 4), *std::max_element(c, c + 4));
+  }
+
+  /** Returns 1 if the predicate holds for all values from the ranges, 0 if it holds for none of them and -1
+      otherwise.
+    */
+  static int compare(llvm::CmpInst::Predicate p, Range const &a, Range const &b) {
+    if (a.isEmpty() or b.isEmpty()) {
+      return -1;
+    }
+    switch (p) {
+      case llvm::CmpInst::ICMP_EQ:
+        if (a.isConst() and a == b) {
+          return 1;
+        }
+        return a.meet(b).isEmpty() ? 0 : -1;
+      case llvm::CmpInst::ICMP_NE: {
+        int eq = compare(llvm::CmpInst::ICMP_EQ, a, b);
+        return eq == -1 ? -1 : 1 - eq;
+      }
+      case llvm::CmpInst::ICMP_SLT:
+        return a.hi_ < b.lo_ ? 1 : (a.lo_ >= b.hi_ ? 0 : -1);
+      case llvm::CmpInst::ICMP_SLE:
+        return a.hi_ <= b.lo_ ? 1 : (a.lo_ > b.hi_ ? 0 : -1);
+      case llvm::CmpInst::ICMP_SGT:
+        return compare(llvm::CmpInst::ICMP_SLT, b, a);
+      case llvm::CmpInst::ICMP_SGE:
+        return compare(llvm::CmpInst::ICMP_SLE, b, a);
+      default:
+        return -1;
+    }
+  }
+
+  /** Narrows the range of a knowing that a p b holds. */
+  static Range refine(llvm::CmpInst::Predicate p, Range const &a, Range const &b) {
+    if (a.isEmpty() or b.isEmpty()) {
+      return a;
+    }
+    switch (p) {
+      case llvm::CmpInst::ICMP_EQ:
+        return a.meet(b);
+      case llvm::CmpInst::ICMP_NE:
+        if (b.isConst() and a.lo_ == b.lo_) {
+          return Range(a.lo_ + 1, a.hi_);
+        }
+        if (b.isConst() and a.hi_ == b.lo_) {
+          return Range(a.lo_, a.hi_ - 1);
+        }
+        return a;
+      case llvm::CmpInst::ICMP_SLT:
+        return a.meet(Range(minValue(), b.hi_ - 1));
+      case llvm::CmpInst::ICMP_SLE:
+        return a.meet(Range(minValue(), b.hi_));
+      case llvm::CmpInst::ICMP_SGT:
+        return a.meet(Range(b.lo_ + 1, maxValue()));
+      case llvm::CmpInst::ICMP_SGE:
+        return a.meet(Range(b.lo_, maxValue()));
+      default:
+        return a;
+    }
+  }
+
+ private:
+
+  /** The arithmetic wraps around, so any result outside of the type's bounds can be anything. */
+  static Range wrap(int64_t lo, int64_t hi) {
+    if (lo < minValue() or hi > maxValue()) {
+      return full();
+    }
+    return Range(lo, hi);
+  }
+
+  int64_t lo_;
+  int64_t hi_;
+};
+
+namespace vrp {
+
+/** Value range propagation.
+
+    Tracks signed intervals of SSA values and of the local variables cp can track. Blocks are processed in reverse
+    post-order by the worklist and the state on every CFG edge is narrowed by the branch condition, so the body of
+    `while i < n` knows that i < n. A block is visited again only when something it reads changed: the state or the
+    narrowed operands of the comparison on an edge leading to it, or the range of a value it uses. Phi nodes use the
+    values of their own block too, on the next entry to it, and branches narrow their successors by the operands of
+    their comparisons wherever those are computed. Loop headers are widened once they were visited a few times, which
+    makes the analysis terminate, and a few descending passes without widening afterwards recover the bounds the loop
+    exit tests impose.
+  */
+class Analysis : public llvm::FunctionPass {
+ public:
+
+  static char ID;
+
+  /** Number of visits of a loop header before its state is widened. */
+  static constexpr unsigned WIDENING_DELAY = 2;
+
+  /** Number of descending passes over the function after the fixpoint is reached. */
+  static constexpr unsigned NARROWING_PASSES = 2;
+
+  Analysis() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "ValueRangeAnalysis";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.setPreservesAll();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    number(f);
+
+    // the entry is reached with arguments and uninitialized variables which can be anything
+    q_.push(&f.getEntryBlock());
+    while (not q_.empty()) {
+      visitBlock(q_.pop(), true);
+    }
+
+    // the fixpoint is sound, recompute it without widening to recover the bounds lost by it
+    for (unsigned i = 0; i != NARROWING_PASSES; ++i) {
+      for (llvm::BasicBlock *b : order_) {
+        if (visits_[blockIndex_[b]] != 0) {
+          visitBlock(b, false);
+        }
+      }
+    }
+    return false;
+  }
+
+  /** Returns the range of the value. */
+  Range range(llvm::Value *v) const {
+    if (llvm::ConstantInt *ci = llvm::dyn_cast<llvm::ConstantInt>(v)) {
+      return Range::constant(ci->getBitWidth() == 1 ? ci->getZExtValue() : ci->getSExtValue());
+    }
+    auto i = index_.find(v);
+    if (i == index_.end()) {
+      return Range::full();
+    }
+    return ranges_[i->second];
+  }
+
+  /** Returns the range of the value at the beginning of the given block, narrowed by the branch leading to the
+      block if it has a single predecessor.
+    */
+  Range range(llvm::Value *v, llvm::BasicBlock *b) const {
+    llvm::BasicBlock *pred = b->getSinglePredecessor();
+    if (pred == nullptr) {
+      return range(v);
+    }
+    return rangeOnEdge(v, pred, b);
+  }
+
+  /** Returns true if the block was reached by the analysis. */
+  bool isVisited(llvm::BasicBlock *b) const {
+    auto i = blockIndex_.find(b);
+    return i != blockIndex_.end() and visits_[i->second] != 0;
+  }
+
+  /** Returns true if the value can never be zero. */
+  bool isNonZero(llvm::Value *v) const {
+    Range r = range(v);
+    return not r.isEmpty() and not r.contains(0);
+  }
+
+  /** Returns an upper bound on the number of times the exit test of the loop is executed, or 0 if there is none.
+
+      The loop must have a single exit test comparing a variable which is changed by the same constant step exactly
+      once per iteration, by the latch. Such variable is strictly monotonic as long as it does not wrap, so it can
+      only take as many values as fit in its range at the exit test.
+    */
+  unsigned maxTripCount(llvm::Loop *l) const {
+    llvm::BasicBlock *exiting = l->getExitingBlock();
+    llvm::BasicBlock *latch = l->getLoopLatch();
+    if (exiting == nullptr or latch == nullptr or not isVisited(exiting)) {
+      return 0;
+    }
+    llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(exiting->getTerminator());
+    llvm::CmpInst::Predicate p;
+    llvm::Value *lhs;
+    llvm::Value *rhs;
+    if (br == nullptr or not br->isConditional() or not decode(br->getCondition(), p, lhs, rhs)) {
+      return 0;
+    }
+    for (llvm::Value *v : {lhs, rhs}) {
+      int64_t step = inductionStep(v, l, latch);
+      if (step == 0) {
+        continue;
+      }
+      Range r = range(v);
+      if (r.isEmpty() or r.lo() + std::min<int64_t>(step, 0) < Range::minValue()
+          or r.hi() + std::max<int64_t>(step, 0) > Range::maxValue()) {
+        continue;
+      }
+      int64_t trips = (r.hi() - r.lo()) / (step < 0 ? -step : step) + 1;
+      return trips > std::numeric_limits<unsigned>::max() ? 0 : static_cast<unsigned>(trips);
+    }
+    return 0;
+  }
+
+  /** Splits a branch condition into the comparison it tests. Looks through the `icmp ne (zext x), 0` the compiler
+      emits for conditions.
+    */
+  static bool decode(llvm::Value *cond, llvm::CmpInst::Predicate &p, llvm::Value *&lhs, llvm::Value *&rhs) {
+    llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(cond);
+    if (cmp == nullptr) {
+      return false;
+    }
+    bool inverted = false;
+    while (cmp->isEquality() and llvm::isa<llvm::ConstantInt>(cmp->getOperand(1))
+        and llvm::cast<llvm::ConstantInt>(cmp->getOperand(1))->isZero()) {
+      llvm::ZExtInst *zext = llvm::dyn_cast<llvm::ZExtInst>(cmp->getOperand(0));
+      llvm::ICmpInst *inner = zext == nullptr ? nullptr : llvm::dyn_cast<llvm::ICmpInst>(zext->getOperand(0));
+      if (inner == nullptr) {
+        break;
+      }
+      if (cmp->getPredicate() == llvm::CmpInst::ICMP_EQ) {
+        inverted = not inverted;
+      }
+      cmp = inner;
+    }
+    p = inverted ? cmp->getInversePredicate() : cmp->getPredicate();
+    lhs = cmp->getOperand(0);
+    rhs = cmp->getOperand(1);
+    return true;
+  }
+
+ private:
+
+  /** Known ranges of tracked variables, any variable which is not in the state may hold any value. */
+  typedef llvm::SmallDenseMap<unsigned, Range, 4> State;
+
+  static Range slotRange(State const &state, unsigned slot) {
+    auto i = state.find(slot);
+    return i == state.end() ? Range::full() : i->second;
+  }
+
+  static void setSlot(State &state, unsigned slot, Range const &r) {
+    if (r.isFull()) {
+      state.erase(slot);
+    } else {
+      state[slot] = r;
+    }
+  }
+
+  /** Joins, or widens, the other state into the state. Only the slots the state knows can change. */
+  static void mergeState(State &state, State const &other, bool widen) {
+    llvm::SmallVector<unsigned, 8> unknown;
+    for (auto &s : state) {
+      Range r = slotRange(other, s.first);
+      s.second = widen ? s.second.widen(r) : s.second.join(r);
+      if (s.second.isFull()) {
+        unknown.push_back(s.first);
+      }
+    }
+    for (unsigned s : unknown) {
+      state.erase(s);
+    }
+  }
+
+  static bool sameState(State const &a, State const &b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (auto const &s : a) {
+      auto i = b.find(s.first);
+      if (i == b.end() or i->second != s.second) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /** Numbers values, blocks, CFG edges and tracked local variables densely. */
+  void number(llvm::Function &f) {
+    index_.clear();
+    blockIndex_.clear();
+    slotIndex_.clear();
+    ranges_.clear();
+    edgeBase_.clear();
+    order_.clear();
+    slots_ = 0;
+
+    for (llvm::Argument &arg : f.args()) {
+      index_[&arg] = ranges_.size();
+      ranges_.push_back(Range::full());
+    }
+    unsigned edges = 0;
+    for (llvm::BasicBlock &b : f) {
+      blockIndex_[&b] = edgeBase_.size();
+      edgeBase_.push_back(edges);
+      edges += b.getTerminator()->getNumSuccessors();
+      for (llvm::Instruction &ins : b) {
+        index_[&ins] = ranges_.size();
+        ranges_.push_back(Range());
+        if (llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(&ins)) {
+          if (cp::Analysis::isTracked(alloca)) {
+            slotIndex_[alloca] = slots_++;
+          }
+        }
+      }
+    }
+    visits_.assign(edgeBase_.size(), 0);
+    edgeLive_.assign(edges, false);
+    edgeStates_.assign(edges, State());
+    in_.assign(edgeBase_.size(), State());
+    edgeOperands_.assign(edges, std::make_pair(Range(), Range()));
+
+    // the successors of a branch depend on the operands of its comparison, wherever those are computed
+    dependents_.clear();
+    for (llvm::BasicBlock &b : f) {
+      llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(b.getTerminator());
+      llvm::CmpInst::Predicate p;
+      llvm::Value *lhs;
+      llvm::Value *rhs;
+      if (br != nullptr and br->isConditional() and decode(br->getCondition(), p, lhs, rhs)) {
+        dependents_[lhs].push_back(&b);
+        dependents_[rhs].push_back(&b);
+      }
+    }
+
+    q_.reset(f);
+    for (llvm::BasicBlock *b : llvm::ReversePostOrderTraversal<llvm::Function *>(&f)) {
+      order_.push_back(b);
+    }
+  }
+
+  void visitBlock(llvm::BasicBlock *b, bool widen) {
+    unsigned bi = blockIndex_[b];
+    ++visits_[bi];
+    bool widening = widen and q_.isLoopHeader(b) and visits_[bi] > WIDENING_DELAY;
+
+    // the incomming state is the join of the states on all edges leading to the block, nothing is known at entry
+    State &in = in_[bi];
+    currentState_.clear();
+    if (b != &b->getParent()->getEntryBlock()) {
+      bool first = true;
+      for (llvm::BasicBlock *pred : llvm::predecessors(b)) {
+        forEachLiveEdge(pred, b, [this, &first](State const &state) {
+          if (first) {
+            currentState_ = state;
+            first = false;
+          } else {
+            mergeState(currentState_, state, false);
+          }
+        });
+      }
+    }
+    if (widening) {
+      mergeState(in, currentState_, true);
+    } else {
+      in = currentState_;
+    }
+    currentState_ = in;
+
+    for (llvm::Instruction &ins : *b) {
+      Range result;
+      if (llvm::isa<llvm::TerminatorInst>(ins)) {
+        visitTerminator(b, widen);
+        continue;
+      } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+        auto slot = slotIndex_.find(store->getPointerOperand());
+        if (slot != slotIndex_.end()) {
+          setSlot(currentState_, slot->second, range(store->getValueOperand(), b));
+        }
+        continue;
+      } else if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+        auto slot = slotIndex_.find(load->getPointerOperand());
+        result = slot == slotIndex_.end() ? Range::full() : slotRange(currentState_, slot->second);
+      } else if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(&ins)) {
+        for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e; ++i) {
+          llvm::BasicBlock *pred = phi->getIncomingBlock(i);
+          if (isLive(pred, b)) {
+            result = result.join(rangeOnEdge(phi->getIncomingValue(i), pred, b));
+          }
+        }
+        if (widening) {
+          result = ranges_[index_[phi]].widen(result);
+        }
+      } else {
+        result = evaluate(&ins, b);
+      }
+      Range &r = ranges_[index_[&ins]];
+      if (r != result) {
+        r = result;
+        if (widen) {
+          reschedule(&ins, b);
+        }
+      }
+    }
+  }
+
+  /** Schedules the visited blocks reading the changed value of an instruction of the block. Users in the block
+      itself have already seen it, except for phi nodes, which read it on the next entry to the block.
+    */
+  void reschedule(llvm::Instruction *ins, llvm::BasicBlock *b) {
+    for (llvm::User *u : ins->users()) {
+      llvm::BasicBlock *ub = llvm::cast<llvm::Instruction>(u)->getParent();
+      if ((ub != b or llvm::isa<llvm::PHINode>(u)) and visits_[blockIndex_[ub]] != 0) {
+        q_.push(ub);
+      }
+    }
+    auto d = dependents_.find(ins);
+    if (d != dependents_.end()) {
+      for (llvm::BasicBlock *db : d->second) {
+        if (db != b and visits_[blockIndex_[db]] != 0) {
+          q_.push(db);
+        }
+      }
+    }
+  }
+
+  /** Propagates the state over the feasible outgoing edges, narrowing it by the branch condition. A successor is
+      scheduled when its edge becomes live or what flows over it changes: the state or the narrowed operands of the
+      comparison, which values in the successor and its phi nodes take.
+    */
+  void visitTerminator(llvm::BasicBlock *b, bool widen) {
+    llvm::TerminatorInst *t = b->getTerminator();
+    unsigned base = edgeBase_[blockIndex_[b]];
+    for (unsigned i = 0, e = t->getNumSuccessors(); i != e; ++i) {
+      llvm::BasicBlock *succ = t->getSuccessor(i);
+      unsigned edge = base + i;
+      edgeState_ = currentState_;
+      if (not refineEdge(b, succ, edgeState_)) {
+        continue;
+      }
+      std::pair<Range, Range> operands = operandsOnEdge(b, succ);
+      bool changed = not edgeLive_[edge] or operands != edgeOperands_[edge]
+          or not sameState(edgeState_, edgeStates_[edge]);
+      edgeLive_[edge] = true;
+      edgeStates_[edge] = edgeState_;
+      edgeOperands_[edge] = operands;
+      if (widen and changed) {
+        q_.push(succ);
+      }
+    }
+  }
+
+  /** Ranges of the operands of the comparison deciding the edge, narrowed by it. */
+  std::pair<Range, Range> operandsOnEdge(llvm::BasicBlock *from, llvm::BasicBlock *to) const {
+    llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(from->getTerminator());
+    llvm::CmpInst::Predicate p;
+    llvm::Value *lhs;
+    llvm::Value *rhs;
+    if (br == nullptr or not br->isConditional() or not decode(br->getCondition(), p, lhs, rhs)) {
+      return std::make_pair(Range(), Range());
+    }
+    return std::make_pair(rangeOnEdge(lhs, from, to), rangeOnEdge(rhs, from, to));
+  }
+
+  /** Narrows the memory state on the edge by the branch condition. Returns false if the edge cannot be taken. */
+  bool refineEdge(llvm::BasicBlock *from, llvm::BasicBlock *to, State &state) const {
+    llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(from->getTerminator());
+    if (br == nullptr or not br->isConditional() or br->getSuccessor(0) == br->getSuccessor(1)) {
+      return true;
+    }
+    bool taken = br->getSuccessor(0) == to;
+    Range cond = range(br->getCondition());
+    if (cond.isEmpty() or not cond.contains(taken ? 1 : 0)) {
+      return false;
+    }
+    llvm::CmpInst::Predicate p;
+    llvm::Value *lhs;
+    llvm::Value *rhs;
+    if (not decode(br->getCondition(), p, lhs, rhs)) {
+      return true;
+    }
+    if (not taken) {
+      p = llvm::CmpInst::getInversePredicate(p);
+    }
+    refineSlot(from, lhs, Range::refine(p, range(lhs), range(rhs)), state);
+    refineSlot(from, rhs, Range::refine(llvm::CmpInst::getSwappedPredicate(p), range(rhs), range(lhs)), state);
+    return true;
+  }
+
+  /** If the value was loaded from a tracked variable which is not stored to afterwards in the block, the variable
+      gets the narrowed range as well.
+    */
+  void refineSlot(llvm::BasicBlock *b, llvm::Value *v, Range const &r, State &state) const {
+    llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(v);
+    if (load == nullptr or load->getParent() != b) {
+      return;
+    }
+    auto slot = slotIndex_.find(load->getPointerOperand());
+    if (slot == slotIndex_.end()) {
+      return;
+    }
+    for (llvm::Instruction *i = load->getNextNode(); i != nullptr; i = i->getNextNode()) {
+      llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(i);
+      if (store != nullptr and store->getPointerOperand() == load->getPointerOperand()) {
+        return;
+      }
+    }
+    setSlot(state, slot->second, slotRange(state, slot->second).meet(r));
+  }
+
+  /** Range of a value flowing over the edge from -> to. */
+  Range rangeOnEdge(llvm::Value *v, llvm::BasicBlock *from, llvm::BasicBlock *to) const {
+    Range result = range(v);
+    llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(from->getTerminator());
+    llvm::CmpInst::Predicate p;
+    llvm::Value *lhs;
+    llvm::Value *rhs;
+    if (br == nullptr or not br->isConditional() or br->getSuccessor(0) == br->getSuccessor(1)
+        or not decode(br->getCondition(), p, lhs, rhs)) {
+      return result;
+    }
+    if (br->getSuccessor(0) != to) {
+      p = llvm::CmpInst::getInversePredicate(p);
+    }
+    if (v == lhs) {
+      result = Range::refine(p, result, range(rhs));
+    }
+    if (v == rhs) {
+      result = Range::refine(llvm::CmpInst::getSwappedPredicate(p), result, range(lhs));
+    }
+    return result;
+  }
+
+  bool isLive(llvm::BasicBlock *from, llvm::BasicBlock *to) const {
+    bool result = false;
+    forEachLiveEdge(from, to, [&result](State const &) {
+      result = true;
+    });
+    return result;
+  }
+
+  template<typename F>
+  void forEachLiveEdge(llvm::BasicBlock *from, llvm::BasicBlock *to, F const &f) const {
+    auto bi = blockIndex_.find(from);
+    if (bi == blockIndex_.end()) {
+      return;
+    }
+    llvm::TerminatorInst *t = from->getTerminator();
+    for (unsigned i = 0, e = t->getNumSuccessors(); i != e; ++i) {
+      unsigned edge = edgeBase_[bi->second] + i;
+      if (t->getSuccessor(i) == to and edgeLive_[edge]) {
+        f(edgeStates_[edge]);
+      }
+    }
+  }
+
+  Range evaluate(llvm::Instruction *ins, llvm::BasicBlock *b) const {
+    if (llvm::BinaryOperator *bop = llvm::dyn_cast<llvm::BinaryOperator>(ins)) {
+      Range lhs = range(bop->getOperand(0), b);
+      Range rhs = range(bop->getOperand(1), b);
+      switch (bop->getOpcode()) {
+        case llvm::Instruction::Add:return Range::add(lhs, rhs);
+        case llvm::Instruction::Sub:return Range::sub(lhs, rhs);
+        case llvm::Instruction::Mul:return Range::mul(lhs, rhs);
+        case llvm::Instruction::SDiv:return Range::sdiv(lhs, rhs);
+        default:return Range::full();
+      }
+    } else if (llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(ins)) {
+      Range lhs = range(cmp->getOperand(0), b);
+      Range rhs = range(cmp->getOperand(1), b);
+      if (lhs.isEmpty() or rhs.isEmpty()) {
+        return Range();
+      }
+      switch (Range::compare(cmp->getPredicate(), lhs, rhs)) {
+        case 1:return Range::constant(1);
+        case 0:return Range::constant(0);
+        default:return Range(0, 1);
+      }
+    } else if (llvm::ZExtInst *zext = llvm::dyn_cast<llvm::ZExtInst>(ins)) {
+      return range(zext->getOperand(0), b);
+    }
+    return ins->getType()->isIntegerTy(1) ? Range(0, 1) : Range::full();
+  }
+
+  /** Returns the constant step of a variable changed exactly once per iteration by the latch, or 0. */
+  int64_t inductionStep(llvm::Value *v, llvm::Loop *l, llvm::BasicBlock *latch) const {
+    llvm::Value *address = nullptr;
+    llvm::Value *next = nullptr;
+    if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(v)) {
+      if (phi->getParent() != l->getHeader()) {
+        return 0;
+      }
+      next = phi->getIncomingValueForBlock(latch);
+    } else if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(v)) {
+      address = load->getPointerOperand();
+      if (slotIndex_.find(address) == slotIndex_.end()) {
+        return 0;
+      }
+      llvm::StoreInst *update = nullptr;
+      for (llvm::User *u : address->users()) {
+        llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(u);
+        if (store == nullptr or not l->contains(store)) {
+          continue;
+        }
+        if (update != nullptr or store->getParent() != latch) {
+          return 0;
+        }
+        update = store;
+      }
+      if (update == nullptr) {
+        return 0;
+      }
+      next = update->getValueOperand();
+    } else {
+      // a rotated loop tests the updated value, which steps along with the variable it is the next value of
+      for (auto i = l->getHeader()->begin(); llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(i); ++i) {
+        if (phi->getIncomingValueForBlock(latch) == v) {
+          return inductionStep(phi, l, latch);
+        }
+      }
+      return 0;
+    }
+
+    llvm::BinaryOperator *bop = llvm::dyn_cast_or_null<llvm::BinaryOperator>(next);
+    if (bop == nullptr or (bop->getOpcode() != llvm::Instruction::Add and bop->getOpcode() != llvm::Instruction::Sub)) {
+      return 0;
+    }
+    llvm::ConstantInt *step = llvm::dyn_cast<llvm::ConstantInt>(bop->getOperand(1));
+    llvm::Value *base = bop->getOperand(0);
+    if (step == nullptr and bop->getOpcode() == llvm::Instruction::Add) {
+      step = llvm::dyn_cast<llvm::ConstantInt>(bop->getOperand(0));
+      base = bop->getOperand(1);
+    }
+    if (step == nullptr) {
+      return 0;
+    }
+    // the updated value must be the variable itself
+    if (address == nullptr) {
+      if (base != v) {
+        return 0;
+      }
+    } else {
+      llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(base);
+      if (load == nullptr or load->getPointerOperand() != address) {
+        return 0;
+      }
+    }
+    return bop->getOpcode() == llvm::Instruction::Add ? step->getSExtValue() : -step->getSExtValue();
+  }
+
+  llvm::DenseMap<llvm::Value *, unsigned> index_;
+  llvm::DenseMap<llvm::BasicBlock *, unsigned> blockIndex_;
+  llvm::DenseMap<llvm::Value *, unsigned> slotIndex_;
+  unsigned slots_ = 0;
+
+  std::vector<Range> ranges_;
+  std::vector<unsigned> visits_;
+  std::vector<unsigned> edgeBase_;
+  std::vector<bool> edgeLive_;
+  std::vector<State> edgeStates_;
+  std::vector<State> in_;
+  State currentState_;
+  State edgeState_;
+  std::vector<std::pair<Range, Range>> edgeOperands_;
+  llvm::DenseMap<llvm::Value *, llvm::SmallVector<llvm::BasicBlock *, 2>> dependents_;
+
+  std::vector<llvm::BasicBlock *> order_;
+  Worklist q_;
+};
+
+class Optimization : public llvm::FunctionPass {
+ public:
+
+  static char ID;
+
+  static llvm::Statistic constants;
+  static llvm::Statistic compares;
+  static llvm::Statistic branches;
+
+  Optimization() :
+      llvm::FunctionPass(ID) {
+  }
+
+  llvm::StringRef getPassName() const override {
+    return "ValueRangeOptimization";
+  }
+
+  void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+    au.addRequired<Analysis>();
+    au.addRequired<llvm::LoopInfoWrapperPass>();
+  }
+
+  /** Returns the bound on the exit tests of the loop recorded by the pass, or 0. */
+  static unsigned maxTripCount(llvm::Loop *l) {
+    llvm::BasicBlock *exiting = l->getExitingBlock();
+    if (exiting == nullptr) {
+      return 0;
+    }
+    llvm::MDNode *md = exiting->getTerminator()->getMetadata("mila.trips");
+    if (md == nullptr) {
+      return 0;
+    }
+    return llvm::mdconst::extract<llvm::ConstantInt>(md->getOperand(0))->getZExtValue();
+  }
+
+  bool runOnFunction(llvm::Function &f) override {
+    bool changed = false;
+    Analysis &a = getAnalysis<Analysis>();
+    llvm::LoopInfo &li = getAnalysis<llvm::LoopInfoWrapperPass>().getLoopInfo();
+
+    // record the trip count bounds for the unroller while the loops are intact, the bound is a hint which does not
+    // change the code and is only rewritten when it changed
+    for (llvm::Loop *l : li.getLoopsInPreorder()) {
+      unsigned trips = a.maxTripCount(l);
+      if (trips != 0 and trips != maxTripCount(l)) {
+        llvm::LLVMContext &ctx = f.getContext();
+        llvm::Metadata *bound = llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(ctx, llvm::APInt(32, trips)));
+        l->getExitingBlock()->getTerminator()->setMetadata("mila.trips", llvm::MDNode::get(ctx, bound));
+      }
+    }
+
+    llvm::SmallVector<llvm::Instruction *, 32> folded;
+    for (llvm::BasicBlock &b : f) {
+      if (not a.isVisited(&b)) {
+        continue;
+      }
+      for (llvm::Instruction &ins : b) {
+        if (not ins.getType()->isIntegerTy() or ins.mayHaveSideEffects()) {
+          continue;
+        }
+        Range r = a.range(&ins);
+        if (not r.isEmpty() and r.isConst()) {
+          ins.replaceAllUsesWith(llvm::ConstantInt::get(ins.getType(), r.lo(), true));
+          folded.push_back(&ins);
+          ++constants;
+          changed = true;
+        } else if (llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(&ins)) {
+          if (simplifyCompare(a, cmp)) {
+            ++compares;
+            changed = true;
+          }
+        }
+      }
+    }
+    for (llvm::Instruction *ins : folded) {
+      ins->eraseFromParent();
+    }
+
+    // branches on folded compares
+    for (llvm::BasicBlock &b : f) {
+      llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(b.getTerminator());
+      if (br != nullptr and br->isConditional() and llvm::isa<llvm::ConstantInt>(br->getCondition())) {
+        cp::Optimization::foldBranch(&b, not llvm::cast<llvm::ConstantInt>(br->getCondition())->isZero());
+        ++branches;
+        changed = true;
+      }
+    }
+    return cp::Optimization::removeUnreachableBlocks(f) or changed;
+  }
+
+ private:
+
+  /** Turns an ordering test against a constant bound the other operand never crosses into an equality test, which
+      is what the exit tests of counting loops look like: i < n with i in [0, n] is i != n.
+    */
+  bool simplifyCompare(Analysis &a, llvm::ICmpInst *cmp) {
+    llvm::ConstantInt *bound = llvm::dyn_cast<llvm::ConstantInt>(cmp->getOperand(1));
+    if (bound == nullptr or not cmp->isSigned()) {
+      return false;
+    }
+    Range r = a.range(cmp->getOperand(0), cmp->getParent());
+    if (r.isEmpty()) {
+      return false;
+    }
+    int64_t c = bound->getSExtValue();
+    int64_t edge;
+    switch (cmp->getPredicate()) {
+      case llvm::CmpInst::ICMP_SLT:
+        // x < c is x != c when x <= c
+        if (r.hi() > c) {
+          return false;
+        }
+        edge = c;
+        break;
+      case llvm::CmpInst::ICMP_SLE:
+        // x <= c is x != c + 1 when x <= c + 1
+        if (r.hi() > c + 1 or c + 1 > Range::maxValue()) {
+          return false;
+        }
+        edge = c + 1;
+        break;
+      case llvm::CmpInst::ICMP_SGT:
+        // x > c is x != c when x >= c
+        if (r.lo() < c) {
+          return false;
+        }
+        edge = c;
+        break;
+      case llvm::CmpInst::ICMP_SGE:
+        // x >= c is x != c - 1 when x >= c - 1
+        if (r.lo() < c - 1 or c - 1 < Range::minValue()) {
+          return false;
+        }
+        edge = c - 1;
+        break;
+      default:
+        return false;
+    }
+    cmp->setPredicate(llvm::CmpInst::ICMP_NE);
+    cmp->setOperand(1, llvm::ConstantInt::get(bound->getType(), edge, true));
+    return true;
+  }
+
+};
+
+}
+
+}
+
+#endif
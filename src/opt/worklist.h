@@ -0,0 +1,180 @@
+#ifndef OPT_WORKLIST_H
+#define OPT_WORKLIST_H
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <vector>
+
+#include "mila.h"
+#include "llvm.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/IR/CFG.h"
+
+namespace mila {
+
+/** Block visit counters of a worklist. */
+class WorklistStats {
+ public:
+  /** Number of times a block was scheduled. */
+  size_t pushes = 0;
+
+  /** Number of schedules dropped because the block was already in the queue. This is not the number of visits saved
+      over a FIFO without deduplication, which would visit the blocks in a different order and schedule them
+      differently as well.
+    */
+  size_t duplicates = 0;
+
+  /** Number of blocks handed out for processing. */
+  size_t visits = 0;
+
+  WorklistStats &operator+=(WorklistStats const &other) {
+    pushes += other.pushes;
+    duplicates += other.duplicates;
+    visits += other.visits;
+    return *this;
+  }
+};
+
+/** Worklist of basic blocks for iterative dataflow analyses.
+
+    A block is in the queue at most once, which is tracked by a bitset indexed by the block's number, and the queued
+    block with the lowest number is handed out first. Blocks are numbered in reverse post-order, except that the blocks
+    of a loop are numbered right after its header, inner loops nested the same way. A rescheduled loop header thus
+    comes before every block after its loop, so the loop is stabilized before its exits are visited, and with reducible
+    control flow a block is still only visited after all its forward predecessors. Targets of back edges are also
+    remembered as loop headers for analyses which widen there.
+  */
+class Worklist {
+ public:
+
+  /** Numbers the blocks of the function, empties the queue and clears the counters. */
+  void reset(llvm::Function &f) {
+    order_.clear();
+    index_.clear();
+    queue_ = Queue();
+    stats_ = WorklistStats();
+
+    llvm::ReversePostOrderTraversal<llvm::Function *> rpot(&f);
+    for (llvm::BasicBlock *b : rpot) {
+      index_[b] = order_.size();
+      order_.push_back(b);
+    }
+    unsigned n = order_.size();
+
+    // the loops containing each block, named by the reverse post-order numbers of their headers, outermost first,
+    // followed by the block's own number
+    std::vector<llvm::SmallVector<unsigned, 4>> keys(n);
+    std::vector<unsigned> marked(n, n);
+    std::vector<bool> headers(n, false);
+    std::vector<llvm::BasicBlock *> work;
+    for (unsigned j = 0; j != n; ++j) {
+      // the sources of back edges to the block are the latches of its loop, the body is what reaches them
+      for (llvm::BasicBlock *pred : llvm::predecessors(order_[j])) {
+        auto i = index_.find(pred);
+        if (i != index_.end() and i->second >= j) {
+          work.push_back(pred);
+        }
+      }
+      if (work.empty()) {
+        continue;
+      }
+      headers[j] = true;
+      keys[j].push_back(j);
+      marked[j] = j;
+      while (not work.empty()) {
+        unsigned i = index_[work.back()];
+        work.pop_back();
+        if (marked[i] == j) {
+          continue;
+        }
+        marked[i] = j;
+        keys[i].push_back(j);
+        for (llvm::BasicBlock *pred : llvm::predecessors(order_[i])) {
+          auto p = index_.find(pred);
+          if (p != index_.end() and p->second > j and marked[p->second] != j) {
+            work.push_back(pred);
+          }
+        }
+      }
+    }
+    for (unsigned i = 0; i != n; ++i) {
+      keys[i].push_back(i);
+    }
+
+    std::vector<unsigned> numbering(n);
+    std::iota(numbering.begin(), numbering.end(), 0);
+    std::sort(numbering.begin(), numbering.end(), [&keys](unsigned a, unsigned b) {
+      return std::lexicographical_compare(keys[a].begin(), keys[a].end(), keys[b].begin(), keys[b].end());
+    });
+    std::vector<llvm::BasicBlock *> rpo;
+    rpo.swap(order_);
+    queued_.assign(n, false);
+    header_.assign(n, false);
+    for (unsigned i = 0; i != n; ++i) {
+      unsigned r = numbering[i];
+      index_[rpo[r]] = i;
+      order_.push_back(rpo[r]);
+      header_[i] = headers[r];
+    }
+  }
+
+  /** Schedules the block unless it is already queued. Returns true if it was added. */
+  bool push(llvm::BasicBlock *b) {
+    ++stats_.pushes;
+    unsigned i = order(b);
+    if (queued_[i]) {
+      ++stats_.duplicates;
+      return false;
+    }
+    queued_[i] = true;
+    queue_.push(i);
+    return true;
+  }
+
+  /** Returns the queued block with the lowest number. */
+  llvm::BasicBlock *pop() {
+    unsigned i = queue_.top();
+    queue_.pop();
+    queued_[i] = false;
+    ++stats_.visits;
+    return order_[i];
+  }
+
+  bool empty() const {
+    return queue_.empty();
+  }
+
+  /** Number of a block reachable from the entry. */
+  unsigned order(llvm::BasicBlock *b) const {
+    auto i = index_.find(b);
+    assert(i != index_.end() and "Only blocks reachable from the entry can be scheduled");
+    return i->second;
+  }
+
+  /** Returns true if the block is the target of a back edge. */
+  bool isLoopHeader(llvm::BasicBlock *b) const {
+    auto i = index_.find(b);
+    return i != index_.end() and header_[i->second];
+  }
+
+  WorklistStats const &stats() const {
+    return stats_;
+  }
+
+ private:
+  typedef std::priority_queue<unsigned, std::vector<unsigned>, std::greater<unsigned>> Queue;
+
+  std::vector<llvm::BasicBlock *> order_;
+  llvm::DenseMap<llvm::BasicBlock *, unsigned> index_;
+  std::vector<bool> queued_;
+  std::vector<bool> header_;
+  Queue queue_;
+
+  WorklistStats stats_;
+};
+
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+
+namespace mila {
+
+/** Runs the function passes of a pipeline, repeating groups of them until they stop changing the function.
+
+    Every pass of the pipeline has a pass manager of its own, holding the pass and the analyses it requires, so that
+    each reports whether it changed the function. Consecutive repeated passes form a group which is run over and over
+    until an iteration changes nothing, or the iteration or time budget runs out. A pass is skipped when the function
+    has not changed since its last run, as it would find nothing new. The totals are kept in statistics, and every
+    group reports the changes and time of each of its iterations as an optimization remark, to tune the budget by.
+  */
+class Pipeline {
+ public:
+  /** Iterations of a repeated group per function. */
+  static constexpr unsigned MAX_ITERATIONS = 4;
+
+  /** Time a repeated group may take per function before no further iteration is started. */
+  static constexpr double TIME_BUDGET_MS = 50;
+
+  static llvm::Statistic groups;
+  static llvm::Statistic iterations;
+  static llvm::Statistic runs;
+  static llvm::Statistic skipped;
+  static llvm::Statistic changes;
+  static llvm::Statistic microseconds;
+
+  /** Groups which stopped before reaching their fixpoint. */
+  static llvm::Statistic exhausted;
+
+  explicit Pipeline(llvm::Module *m) :
+      m_(m) {
+  }
+
+  /** Adds a pass manager for the next pass, which the caller fills in. */
+  llvm::legacy::FunctionPassManager &add(std::string const &name, bool repeated) {
+    passes_.push_back(Pass{name, std::unique_ptr<llvm::legacy::FunctionPassManager>(
+        new llvm::legacy::FunctionPassManager(m_)), repeated});
+    return *passes_.back().pm;
+  }
+
+  bool empty() const {
+    return passes_.empty();
+  }
+
+  bool run(llvm::Function &f) {
+    bool changed = false;
+    for (size_t i = 0, e = passes_.size(); i != e;) {
+      if (not passes_[i].repeated) {
+        changed = passes_[i].pm->run(f) or changed;
+        ++i;
+        continue;
+      }
+      size_t end = i;
+      while (end != e and passes_[end].repeated) {
+        ++end;
+      }
+      changed = fixpoint(f, i, end) or changed;
+      i = end;
+    }
+    return changed;
+  }
+
+ private:
+
+  class Pass {
+   public:
+    std::string name;
+    std::unique_ptr<llvm::legacy::FunctionPassManager> pm;
+    bool repeated;
+  };
+
+  bool fixpoint(llvm::Function &f, size_t begin, size_t end) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    // the function is at version 0 and no pass has seen it yet
+    unsigned version = 0;
+    std::vector<unsigned> seen(end - begin, static_cast<unsigned>(-1));
+    bool converged = false;
+    // changes and microseconds of every iteration
+    llvm::SmallVector<std::pair<unsigned, uint64_t>, MAX_ITERATIONS> perIteration;
+    ++groups;
+    for (unsigned i = 0; i != MAX_ITERATIONS and not converged; ++i) {
+      ++iterations;
+      Clock::time_point iterationStart = Clock::now();
+      unsigned before = version;
+      for (size_t p = begin; p != end; ++p) {
+        if (seen[p - begin] == version) {
+          ++skipped;
+          continue;
+        }
+        ++runs;
+        if (passes_[p].pm->run(f)) {
+          ++version;
+          ++changes;
+        }
+        seen[p - begin] = version;
+      }
+      converged = version == before;
+      Clock::time_point now = Clock::now();
+      perIteration.push_back(std::make_pair(version - before, static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::microseconds>(now - iterationStart).count())));
+      if (std::chrono::duration<double, std::milli>(now - start).count() > TIME_BUDGET_MS) {
+        break;
+      }
+    }
+    microseconds += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    if (not converged) {
+      ++exhausted;
+    }
+    report(f, converged, perIteration);
+    return version != 0;
+  }
+
+  static void report(llvm::Function &f, bool converged,
+                     llvm::ArrayRef<std::pair<unsigned, uint64_t>> perIteration) {
+    llvm::OptimizationRemarkEmitter ore(&f);
+    llvm::OptimizationRemark remark(REMARKS, converged ? "Converged" : "Exhausted", &f);
+    remark << (converged ? "reached the fixpoint after " : "ran out of budget after ")
+           << llvm::ore::NV("Iterations", static_cast<unsigned>(perIteration.size())) << " iterations:";
+    for (auto const &i : perIteration) {
+      remark << " " << llvm::ore::NV("Changes", i.first) << " changes in "
+             << llvm::ore::NV("Microseconds", i.second) << "us";
+    }
+    ore.emit(remark);
+  }
+
+  static constexpr const char *REMARKS = "mila-pipeline";
+
+  llvm::Module *m_;
+  std::vector<Pass> passes_;
+};
+
+}
+
+#endif
@@ -1,4 +1,7 @@
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 #include "mila.h"
 #include "runtime.h"
@@ -13,3 +16,198 @@ extern "C" int read_() {
 extern "C" void write_(int what) {
   std::cout << "Vypis: " << what << std::endl;
 }
+
+namespace mila {
+
+namespace memo {
+
+/** Direct mapped cache of the results of one function. */
+class Table {
+ public:
+  static constexpr unsigned CAPACITY = 4096;
+
+  Table(std::string const &function, unsigned arity) :
+      function(function),
+      arity(arity),
+      keys(CAPACITY * arity),
+      values(CAPACITY),
+      valid(CAPACITY, false) {
+  }
+
+  unsigned slot(int const *args) const {
+    // FNV-1a over the arguments
+    unsigned h = 2166136261u;
+    for (unsigned i = 0; i != arity; ++i) {
+      h = (h ^ static_cast<unsigned>(args[i])) * 16777619u;
+    }
+    return (h ^ (h >> 15)) & (CAPACITY - 1);
+  }
+
+  bool matches(unsigned slot, int const *args) const {
+    if (not valid[slot]) {
+      return false;
+    }
+    for (unsigned i = 0; i != arity; ++i) {
+      if (keys[slot * arity + i] != args[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::string function;
+  unsigned arity;
+  std::vector<int> keys;
+  std::vector<int> values;
+  std::vector<bool> valid;
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+};
+
+std::vector<Table> tables;
+
+int table(std::string const &function, unsigned arity) {
+  tables.emplace_back(function, arity);
+  return static_cast<int>(tables.size() - 1);
+}
+
+void report(std::ostream &out) {
+  for (Table const &t : tables) {
+    out << t.function << ": hits " << t.hits << ", misses " << t.misses << ", evictions " << t.evictions
+        << std::endl;
+  }
+}
+
+}
+
+namespace profile {
+
+/** Counters of one instrumented function, they do not move while the code incrementing them runs. */
+class Function {
+ public:
+  std::string name;
+  unsigned blocks;
+  unsigned branches;
+  std::unique_ptr<uint64_t[]> counts;
+};
+
+std::vector<Function> functions;
+
+/** First line of a profile, files without it are not read. */
+char const *const HEADER = "mila-profile 1";
+
+uint64_t *counters(std::string const &function, unsigned blocks, unsigned branches) {
+  // value initialized, so the counters start at zero
+  std::unique_ptr<uint64_t[]> counts(new uint64_t[blocks + branches]());
+  uint64_t *result = counts.get();
+  functions.push_back(Function{function, blocks, branches, std::move(counts)});
+  return result;
+}
+
+void reset() {
+  functions.clear();
+}
+
+/** The profile lists every function as its name with the number of blocks and branches, followed by the counts of
+    the blocks and then of the branches, each on a line of its own.
+  */
+void write(std::string const &filename) {
+  std::ofstream out(filename);
+  if (not out) {
+    throw Exception(STR("Cannot write profile " << filename));
+  }
+  out << HEADER << std::endl;
+  for (Function const &f : functions) {
+    out << f.name << " " << f.blocks << " " << f.branches << std::endl;
+    for (unsigned i = 0; i != f.blocks; ++i) {
+      out << (i == 0 ? "" : " ") << f.counts[i];
+    }
+    out << std::endl;
+    for (unsigned i = 0; i != f.branches; ++i) {
+      out << (i == 0 ? "" : " ") << f.counts[f.blocks + i];
+    }
+    out << std::endl;
+  }
+}
+
+std::map<std::string, Counts> read(std::string const &filename) {
+  std::ifstream in(filename);
+  std::string header;
+  if (not std::getline(in, header) or header != HEADER) {
+    throw Exception(STR("Cannot read profile " << filename));
+  }
+  std::map<std::string, Counts> result;
+  std::string name;
+  unsigned blocks;
+  unsigned branches;
+  while (in >> name >> blocks >> branches) {
+    Counts &c = result[name];
+    c.blocks.resize(blocks);
+    c.branches.resize(branches);
+    for (uint64_t &count : c.blocks) {
+      in >> count;
+    }
+    for (uint64_t &count : c.branches) {
+      in >> count;
+    }
+    if (not in) {
+      throw Exception(STR("Malformed profile " << filename << " at function " << name));
+    }
+  }
+  return result;
+}
+
+}
+
+namespace tier {
+
+std::vector<std::unique_ptr<Function>> functions;
+
+std::function<void(int)> hot;
+
+int function(std::string const &name) {
+  functions.push_back(std::unique_ptr<Function>(new Function(name)));
+  return static_cast<int>(functions.size() - 1);
+}
+
+Function &get(int index) {
+  return *functions[index];
+}
+
+void onHot(std::function<void(int)> const &handler) {
+  hot = handler;
+}
+
+}
+
+}
+
+extern "C" int memo_lookup_(int table, int const *args, int *result) {
+  mila::memo::Table &t = mila::memo::tables[table];
+  unsigned slot = t.slot(args);
+  if (t.matches(slot, args)) {
+    ++t.hits;
+    *result = t.values[slot];
+    return 1;
+  }
+  ++t.misses;
+  return 0;
+}
+
+extern "C" void memo_store_(int table, int const *args, int result) {
+  mila::memo::Table &t = mila::memo::tables[table];
+  unsigned slot = t.slot(args);
+  if (t.valid[slot] and not t.matches(slot, args)) {
+    ++t.evictions;
+  }
+  std::copy(args, args + t.arity, t.keys.begin() + slot * t.arity);
+  t.values[slot] = result;
+  t.valid[slot] = true;
+}
+
+extern "C" void tier_hot_(int function) {
+  if (mila::tier::hot) {
+    mila::tier::hot(function);
+  }
+}
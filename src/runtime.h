@@ -1,8 +1,97 @@
 #ifndef RUNTIME_H
 #define RUNTIME_H
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
 extern "C" int read_();
 
 extern "C" void write_(int what);
 
+/** Looks up the result of a memoized function for the given arguments. Returns nonzero and sets the result if found.
+  */
+extern "C" int memo_lookup_(int table, int const *args, int *result);
+
+/** Remembers the result of a memoized function, evicting whatever was stored for other arguments with the same hash.
+  */
+extern "C" void memo_store_(int table, int const *args, int result);
+
+/** Called by tiered code on the call which makes a function hot, with the index of its record. */
+extern "C" void tier_hot_(int function);
+
+namespace mila {
+
+namespace memo {
+
+/** Creates the table for a memoized function and returns its index. */
+int table(std::string const &function, unsigned arity);
+
+/** Prints the hits, misses and evictions of every table. */
+void report(std::ostream &out);
+
+}
+
+namespace profile {
+
+/** Execution counts of a function: how often each block ran and how often each conditional branch was taken, both
+    numbered in the order of the function as the compiler emitted it.
+  */
+class Counts {
+ public:
+  std::vector<uint64_t> blocks;
+  std::vector<uint64_t> branches;
+};
+
+/** Allocates zeroed counters for the blocks of a function followed by those of its conditional branches. The
+    instrumented code increments them in place.
+  */
+uint64_t *counters(std::string const &function, unsigned blocks, unsigned branches);
+
+/** Forgets all counters, code still incrementing them must not run anymore. */
+void reset();
+
+/** Writes the counters of all instrumented functions to the file. */
+void write(std::string const &filename);
+
+/** Reads the counts of the functions written by write(). */
+std::map<std::string, Counts> read(std::string const &filename);
+
+}
+
+namespace tier {
+
+/** Record of a function of tiered code. The code counts its calls in it and its callers call the code its address
+    points to, which starts as the baseline and is switched to the optimized code once it is ready. Loops of main
+    have records too, counting their iterations, and their code is the continuation of main once ready.
+  */
+class Function {
+ public:
+  explicit Function(std::string const &name) :
+      name(name),
+      calls(0),
+      code(nullptr) {
+  }
+
+  std::string name;
+  uint64_t calls;
+  std::atomic<void *> code;
+};
+
+/** Creates the record of a function and returns its index. Records do not move, the code refers to them in place. */
+int function(std::string const &name);
+
+Function &get(int index);
+
+/** Sets what tier_hot_ does with the functions which become hot. */
+void onHot(std::function<void(int)> const &handler);
+
+}
+
+}
+
 #endif
@@ -62,11 +62,17 @@ std::string printFunction(llvm::Function * f) {
 
 #define TEST(code) Test(__FILE__, __LINE__, code)
 
+/** Tests a whole program, the code includes the body of main. */
+#define PROGRAM(code) Test(__FILE__, __LINE__, code, true)
+
+/** Tests that the pipeline is refused. */
+#define REJECTED(pipeline) Test::rejected(__FILE__, __LINE__, pipeline)
+
 class Test {
  public:
 
 
-  Test(char const * file, int line, std::string const & code):
+  Test(char const * file, int line, std::string const & code, bool program = false):
       file_(file),
       line_(line),
       ast_(nullptr),
@@ -74,7 +80,7 @@ class Test {
       jit_(nullptr)
   {
     try {
-      ast_ = Parser::parse(Scanner::text(code + "\n begin f() end"));
+      ast_ = Parser::parse(Scanner::text(program ? code : code + "\n begin f() end"));
       main_ = Compiler::compile(ast_);
       jit_ = JIT::compile(main_);
       ++points_;
@@ -227,6 +233,82 @@ class Test {
   }
 
 
+  /** Checks how many calls of the callee the function contains, the printed code does not name callees. */
+  Test & calls(char const * callee, size_t expected, char const * name = "f") {
+    if (main_ != nullptr) {
+      llvm::Function * f = main_->getParent()->getFunction(name);
+      size_t actual = 0;
+      if (f != nullptr) {
+        for (llvm::Instruction & i : llvm::instructions(*f)) {
+          llvm::CallInst * call = llvm::dyn_cast<llvm::CallInst>(&i);
+          if (call != nullptr and call->getCalledFunction() != nullptr and call->getCalledFunction()->getName() == callee)
+            ++actual;
+        }
+      }
+      if (f == nullptr or actual != expected) {
+        printLocation();
+        std::cerr << "  Function " << name << " expected to call " << callee << " " << expected << " times, but calls it "
+                  << actual << " times" << std::endl;
+        ++failures_;
+      } else {
+        ++points_;
+      }
+    }
+    return *this;
+  }
+
+  /** Checks the number of conditional branches which carry branch weights. */
+  Test & weights(size_t expected, char const * name = "f") {
+    if (main_ != nullptr) {
+      llvm::Function * f = main_->getParent()->getFunction(name);
+      size_t actual = 0;
+      if (f != nullptr) {
+        for (llvm::BasicBlock & b : *f) {
+          llvm::BranchInst * br = llvm::dyn_cast<llvm::BranchInst>(b.getTerminator());
+          if (br != nullptr and br->isConditional() and br->getMetadata(llvm::LLVMContext::MD_prof) != nullptr)
+            ++actual;
+        }
+      }
+      if (f == nullptr or actual != expected) {
+        printLocation();
+        std::cerr << "  Function " << name << " expected to have " << expected << " weighted branches, but has "
+                  << actual << std::endl;
+        ++failures_;
+      } else {
+        ++points_;
+      }
+    }
+    return *this;
+  }
+
+  Test & attribute(llvm::Attribute::AttrKind expected, char const * name = "f") {
+    if (main_ != nullptr) {
+      llvm::Function * f = main_->getParent()->getFunction(name);
+      if (f == nullptr or not f->hasFnAttribute(expected)) {
+        printLocation();
+        std::cerr << "  Function " << name << " expected to have attribute "
+                  << llvm::Attribute::get(main_->getContext(), expected).getAsString() << std::endl;
+        ++failures_;
+      } else {
+        ++points_;
+      }
+    }
+    return *this;
+  }
+
+  static void rejected(char const * file, int line, std::string const & pipeline) {
+    JIT::passes = pipeline;
+    try {
+      JIT::compile(Compiler::compile(Parser::parse(Scanner::text("function f() 1\n begin f() end"))));
+      std::cerr << "ERROR: " << file << " [" << line << "]:" << std::endl;
+      std::cerr << "  Pipeline " << pipeline << " expected to be refused" << std::endl;
+      ++failures_;
+    } catch (Exception const &) {
+      ++points_;
+    }
+    JIT::passes = "";
+  }
+
   static void stats() {
     std::cout << "Finished, total points: " << points_ << std::endl;
     std::cout << "              Failures: " << failures_ << std::endl;
@@ -275,7 +357,7 @@ int Test::failures_ = 0;
 
 
 void test_lowering_precise() {
-  JIT::optimize = false;
+  JIT::level = JIT::Level::O0;
   std::cout << "Lowering (precission tests)..." << std::endl;
   TEST("function f() 1")
       .run(1)
@@ -377,7 +459,7 @@ void test_lowering_precise() {
   TEST("function f() 2 + 3 * 4")
       .run(14)
       .code("B mul add ret");
-  JIT::optimize = true;
+  JIT::level = JIT::Level::O2;
 }
 
 void test_lowering() {
@@ -502,6 +584,13 @@ void test_simpleCP() {
   TEST("function f() 1 + 2 = 3")
       .run(1)
       .code("B ret");
+  JIT::passes = "cp;";
+  TEST("function fx(x) begin var a, b; a := 1; b := 2; if (x) then b := 3 else b := 4; if (a) then return b; return 0 end function f() fx(1)")
+      .run(3)
+      .containsSingle("cbr", "fx");
+  TEST("function fx(n) begin var a, i; a := 5; i := 0; while (i < n) do begin i := i + 1; if (i = 2) then a := 6 end return a end function f() fx(3)")
+      .run(6);
+  JIT::passes = "";
 }
 
 void test_cp() {
@@ -515,10 +604,10 @@ void test_cp() {
       .containsNot("load");
   TEST("function fx(x) begin var a, b; a := 1; b := 2; if (x) then a; else b; end function f() fx(1)")
       .run(1)
-      .containsSingle("load", "fx");
+      .containsNot("load", "fx");
   TEST("function fx(x) begin var a, b; a := 1; b := 2; if (x) then a; else b; end function f() fx(0)")
       .run(2)
-      .containsSingle("load", "fx");
+      .containsNot("load", "fx");
 
 
 }
@@ -544,14 +633,337 @@ void test_die() {
 
 void test_dce() {
   std::cout << "Dead code elimination..." << std::endl;
-  TEST("function f() begin if (0) then return 1 else return 2 end").run(2).containsNot("cbr");
-  TEST("function f() begin const a = 1 if (a) then return 1 else return 2 end").run(1).containsNot("cbr");
-  TEST("function f() begin var a a := 1 if (a) then return 1 else return 2 end").run(1).containsNot("cbr");
-  TEST("function f() begin while (0) do 1 return 1 end").run(1).containsNot("cbr");
+  TEST("function f() begin if (0) then return 1 else return 2 end").run(2).containsNot("cbr").blocks(2);
+  TEST("function f() begin const a = 1 if (a) then return 1 else return 2 end").run(1).containsNot("cbr").blocks(2);
+  TEST("function f() begin var a a := 1 if (a) then return 1 else return 2 end").run(1).containsNot("cbr").blocks(2);
+  TEST("function f() begin while (0) do 1 return 1 end").run(1).containsNot("cbr").blocks(3);
+  TEST("function f() begin var a a := 2 if (a > 1) then a := 3 else a := 4 return a end").run(3).containsNot("cbr").blocks(3);
+  TEST("function f() begin var i, s; i := 0; s := 0; while (i < 10) do begin s := s + i; i := i + 1 end return 3 end")
+      .run(3)
+      .containsNot("cbr")
+      .blocks(3);
+  TEST("function fx(a) begin var b; if (a) then b := 1 else b := 2; return 5 end function f() fx(1)")
+      .run(5)
+      .containsNot("cbr", "fx");
+  TEST("function fx(a) begin while (a > 0) do begin write a; a := a - 1 end return 5 end function f() fx(1)")
+      .run(5)
+      .containsSingle("call", "fx");
+  JIT::passes = "globals,mem2reg,adce;";
+  TEST("function fx(a) begin var i; i := a; while (i <> 10) do i := i + 3; return 5 end function f() fx(1)")
+      .run(5)
+      .containsSingle("cbr", "fx");
+  TEST("function fx(a) begin var i; i := 0; while (i < 10) do i := i + 3; return 5 end function f() fx(7)")
+      .run(5)
+      .containsNot("cbr", "fx");
+  JIT::passes = "";
   //TEST("function ff(a) begin if(a) then if (0) then return 1 else return 0 else return 3 end function f() ff(1)").run(0).containsSingle("cbr", "ff");
 
 }
 
+void test_mem2reg() {
+  std::cout << "Promotion of variables to registers..." << std::endl;
+  TEST("function fx(a) begin var b; b := a; if (a > 1) then b := b + 1; return b end function f() fx(4)")
+      .run(5)
+      .containsNot("load", "fx")
+      .containsNot("store", "fx")
+      .containsNot("alloca", "fx");
+  TEST("function f() begin var i, b; i := 10; b := 1; while (i <> 0) do begin b := b * 2; i := i - 1; end return b; end")
+      .run(1024)
+      .containsNot("load")
+      .containsNot("store");
+  TEST("function g() begin h := 3; end function f() begin g(); h; end var h")
+      .run(3)
+      .containsSingle("load");
+}
+
+void test_globals() {
+  std::cout << "Promotion of globals..." << std::endl;
+  TEST("function fx(n) begin var i; i := 0; while (i < n) do begin g := g + i; write g; i := i + 1 end return g end function f() begin g := 1; return fx(4) end var g")
+      .run(7)
+      .containsSingle("load", "fx")
+      .containsSingle("store", "fx");
+  TEST("function h() begin return g end function fx(n) begin g := n; return h() + g end function f() fx(3) var g")
+      .run(6)
+      .containsSingle("store", "fx");
+  TEST("function h() begin g := g * 2; return 0 end function fx(n) begin g := n; h(); return g end function f() fx(5) var g")
+      .run(10);
+  TEST("function h(x) begin return x + 1 end function fx(n) begin var i; i := 0; while (i < n) do begin g := h(g); i := i + 1 end return g end function f() begin g := 0; return fx(6) end var g")
+      .run(6)
+      .containsSingle("load", "fx");
+  TEST("function fx(n) begin if (n > 0) then fx(n - 1); g := g + 1; return g end function f() begin g := 0; return fx(2) end var g")
+      .run(3);
+}
+
+void test_vrp() {
+  std::cout << "Value range propagation..." << std::endl;
+  TEST("function f() begin var i; i := 0; while (i < 10) do i := i + 1; return i end")
+      .run(10)
+      .containsNot("slt");
+  TEST("function fx(a) begin if (a > 5) then if (a > 3) then return 1 else return 2 else return 3 end function f() fx(7)")
+      .run(1)
+      .containsSingle("sgt", "fx");
+  TEST("function fx(x) begin var y, r, s; y := 0; s := 0; while (y < 100) do begin if (x < y) then begin if (x > 5) then r := 1 else r := 2; s := s + r end; y := y + 10 end; return s end function f() fx(7)")
+      .run(9);
+}
+
+void test_reassociate() {
+  std::cout << "Reassociation and simplification..." << std::endl;
+  TEST("function fx(a) begin return (a + 3) + 4 end function f() fx(1) + fx(2)")
+      .run(17)
+      .containsSingle("add", "fx");
+  TEST("function fx(a) begin return a + 1 - 1 end function f() fx(3) + fx(4)")
+      .run(7)
+      .containsNot("add", "fx")
+      .containsNot("sub", "fx");
+  TEST("function fx(a, b) begin return a * b - b * a end function f() fx(2, 3) + fx(4, 5)")
+      .run(0)
+      .containsNot("mul", "fx");
+  TEST("function fx(a, b) begin if (a < b) then return 1; return 2 end function f() fx(1, 2) + fx(2, 1) * 10")
+      .run(21)
+      .containsNot("zext", "fx");
+  TEST("function fx(a, b) begin if ((a < b) = 0) then return 1; return 2 end function f() fx(1, 2) + fx(2, 1) * 10")
+      .run(12)
+      .containsNot("zext", "fx")
+      .containsSingle("sge", "fx");
+}
+
+void test_threading() {
+  std::cout << "Jump threading..." << std::endl;
+  TEST("function fx(a) begin var b; if (a > 0) then b := 1 else b := 0; if (b) then return 10; return 20 end function f() fx(1) * 100 + fx(0)")
+      .run(1020)
+      .containsSingle("icmp", "fx");
+  TEST("function fx(a) begin var b; if (a > 0) then b := a else b := 0; if (b) then return 10; return 20 end function f() fx(1) * 100 + fx(0)")
+      .run(1020);
+  TEST("function fx(a) begin var b, c; if (a > 0) then b := 1 else b := 0; c := b + a; if (b) then return c; return c * 2 end function f() fx(3) * 100 + fx(-2)")
+      .run(396)
+      .containsSingle("icmp", "fx");
+}
+
+void test_gvn() {
+  std::cout << "Global value numbering..." << std::endl;
+  TEST("function fx(a, b) begin return (a + b) * (b + a) end function f() fx(2, 3)")
+      .run(25)
+      .containsSingle("add", "fx");
+  TEST("function fx(a, b) begin var c; c := 0; if (a < b) then c := 1; if (a < b) then c := c + 2; return c end function f() fx(2, 3)")
+      .run(3)
+      .containsSingle("slt", "fx");
+  TEST("function f() begin g := 4; return g * g end var g")
+      .run(16)
+      .containsNot("load");
+  TEST("function h() begin g := 1; return 0 end function f() begin var a; g := 4; a := g; h(); return a + g end var g")
+      .run(5)
+      .containsSingle("load");
+}
+
+void test_ipcp() {
+  std::cout << "Interprocedural constant propagation..." << std::endl;
+  TEST("function fx(a, b) begin return a + b end function f() begin return fx(3, 4) + fx(3, 4) end")
+      .run(14)
+      .containsNot("add", "fx");
+  TEST("function fx(a) begin if (a > 0) then return fx(a - 1); return 7 end function f() begin return fx(3) * 2 end")
+      .run(14)
+      .containsNot("mul");
+  TEST("function fx(a, n) begin if (n > 0) then return fx(a, n - 1); return a end function f() fx(6, 3)")
+      .run(6)
+      .containsSingle("call", "fx");
+  TEST("function fx(a) begin return a * 2 end function f() begin return fx(1) + fx(2) end")
+      .run(6);
+}
+
+void test_specialization() {
+  std::cout << "Function specialization..." << std::endl;
+  TEST("function fx(a, b) begin if (a > 0) then return b * 2; return b * 3 end function f() begin var x; x := 5; return fx(1, x) + fx(0, x) end")
+      .run(25)
+      .containsNot("cbr", "fx.1")
+      .containsNot("cbr", "fx.2");
+  TEST("function fx(a, b) begin while (a > 0) do begin b := b + a; a := a - 1 end return b end function f() begin return fx(3, 0) + fx(3, 1) + fx(2, 0) end")
+      .run(16);
+}
+
+void test_attributes() {
+  std::cout << "Attribute inference..." << std::endl;
+  TEST("function fx(a) begin return a * 2 end function f() fx(2)")
+      .run(4)
+      .attribute(llvm::Attribute::ReadNone, "fx")
+      .attribute(llvm::Attribute::NoRecurse, "fx");
+  TEST("function fx() begin return g end function f() begin g := 3; return fx() end var g")
+      .run(3)
+      .attribute(llvm::Attribute::ReadOnly, "fx");
+  TEST("function fx(a) begin write a; return a end function f() fx(2)")
+      .run(2)
+      .attribute(llvm::Attribute::InaccessibleMemOnly, "fx")
+      .attribute(llvm::Attribute::InaccessibleMemOnly, "write_");
+  TEST("function fx(a) begin if (a > 0) then return fx(a - 1); return 0 end function f() fx(2)")
+      .run(0)
+      .attribute(llvm::Attribute::NoUnwind, "fx");
+  // the call becomes dead only once fx is known to be readnone
+  JIT::passes = "globals,mem2reg,dce;attributes";
+  TEST("function fx(a) begin return a * 2 end function f() begin fx(1); return 2 end")
+      .run(2)
+      .calls("fx", 0);
+  JIT::passes = "";
+}
+
+void test_pipelines() {
+  std::cout << "Pipelines..." << std::endl;
+  JIT::passes = "globals,mem2reg;";
+  TEST("function f() begin var i, s; i := 0; s := 0; while (i < 3) do begin s := s + i; i := i + 1 end return s end")
+      .run(3)
+      .containsNot("load")
+      .containsSingle("slt");
+  // cp only sees the constants of the unrolled loop when the group is repeated
+  JIT::passes = "globals,mem2reg,(cp,dce,unroll);";
+  TEST("function f() begin var i, s; i := 0; s := 0; while (i < 4) do begin s := s + i; i := i + 1 end return s end")
+      .run(6)
+      .containsNot("add");
+  JIT::passes = "";
+  REJECTED("(;");
+  REJECTED("(cp,dce;");
+  REJECTED("cp,dce);");
+  REJECTED("((cp,dce));");
+  REJECTED("(cp,(dce));");
+  REJECTED("(),cp;");
+  for (JIT::Level level : {JIT::Level::O0, JIT::Level::O1, JIT::Level::O3, JIT::Level::Os}) {
+    JIT::level = level;
+    TEST("function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin s := s + i * g; i := i + 1 end return s end function f() begin g := 2; return fx(4) end var g")
+        .run(12);
+  }
+  JIT::level = JIT::Level::Os;
+  TEST("function fx(a) begin write a; return a + 1 end function f() fx(2)")
+      .run(3)
+      .containsSingle("call");
+  JIT::level = JIT::Level::O2;
+}
+
+void test_memoize() {
+  std::cout << "Memoization..." << std::endl;
+  JIT::memoize = true;
+  TEST("function fib(n) begin if (n < 2) then return n; return fib(n - 1) + fib(n - 2) end function f() fib(25)")
+      .run(75025)
+      .calls("memo_lookup_", 1, "fib");
+  TEST("function fx(n) begin write n; if (n < 1) then return 0; return fx(n - 1) + 1 end function f() fx(3)")
+      .run(3)
+      .calls("memo_lookup_", 0, "fx");
+  TEST("function fx(a) begin return a * 2 end function f() fx(2)")
+      .run(4)
+      .calls("memo_lookup_", 0, "fx");
+  JIT::memoize = false;
+}
+
+void test_licm() {
+  std::cout << "Loop invariant code motion..." << std::endl;
+  TEST("function fx(a, b) begin var i; i := 0; while (i < a) do begin write a * b; i := i + 1 end return i end function f() fx(3, 4)")
+      .run(3)
+      .containsSingle("mul", "fx");
+  TEST("function h(x) begin return x + 1 end function f() begin var i, s; g := 5; i := 0; s := 0; while (i < 3) do begin s := s + h(g); i := i + 1 end return s end var g")
+      .run(18)
+      .containsNot("load");
+  TEST("function h(x) begin return x * 2 end function f() begin var i; i := 0; while (i < 4) do begin g := h(g) + 1; i := i + 1 end return g end var g")
+      .run(15)
+      .containsSingle("store");
+  TEST("function h() begin g := g + 1; return 0 end function f() begin var i; i := 0; while (i < 4) do begin g := g + h(); i := i + 1 end return g end var g")
+      .run(4);
+  // the divisor is at least one, so the division cannot trap and leaves the loop
+  JIT::passes = "globals,mem2reg,licm;";
+  TEST("function fx(a, b) begin var i, s, d; d := b; if (d < 1) then d := 1; i := 0; s := 0; while (i < a) do begin s := s + 100 / d; i := i + 1 end return s end function f() fx(3, 4) + fx(2, 0)")
+      .run(275)
+      .containsSingle("sdiv br", "fx");
+  JIT::passes = "";
+}
+
+void test_indvars() {
+  std::cout << "Induction variables..." << std::endl;
+  TEST("function f() begin var sum, i, n; sum := 0; i := 0; n := 100; while i < n do begin i := i + 1; sum := sum + i end return sum end")
+      .run(5050)
+      .containsNot("cbr")
+      .containsNot("phi");
+  TEST("function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin s := s + 2; i := i + 1 end return s end function f() fx(21)")
+      .run(42)
+      .containsNot("cbr", "fx");
+  TEST("function fx(n) begin var i; i := 0; while (i < n) do begin write i; i := i + 1 end return i end function f() fx(3)")
+      .run(3);
+}
+
+void test_rotation() {
+  std::cout << "Loop rotation..." << std::endl;
+  JIT::passes = "globals,mem2reg,rotate;";
+  // the header is merged into the latch, leaving the guard, the loop and its exit
+  TEST("function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin s := s + i; i := i + 1 end return s end function f() fx(5)")
+      .run(10)
+      .blocks(3, "fx");
+  TEST("function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin s := s + i; i := i + 1 end return s end function f() fx(0)")
+      .run(0);
+  TEST("function fx(n) begin var i, j, s; i := 0; s := 0; while (i < n) do begin j := 0; while (j < i) do begin s := s + j; j := j + 1 end; i := i + 1 end return s end function f() fx(5)")
+      .run(10);
+  JIT::passes = "";
+  TEST("function fx(n) begin var i; i := 0; while (i < n) do begin write i; i := i + 1 end return i end function f() fx(13)")
+      .run(13);
+}
+
+void test_profile() {
+  std::cout << "Profile guided optimization..." << std::endl;
+  char const *path = "mila-tests.profile";
+  profile::reset();
+  JIT::profileGenerate = path;
+  TEST("function f() 1")
+      .run(1)
+      .code("B load add store ret");
+  TEST("function h(x) begin return x * 3 end function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin if (i > n) then s := s + h(i) else s := s + i; i := i + 1 end return s end function f() fx(10)")
+      .run(45);
+  profile::write(path);
+  JIT::profileGenerate = "";
+  // without a profile the call of h is inlined, the profile knows it never runs
+  JIT::passes = "globals,mem2reg;inline";
+  TEST("function h(x) begin return x * 3 end function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin if (i > n) then s := s + h(i) else s := s + i; i := i + 1 end return s end function f() fx(10)")
+      .run(45)
+      .weights(0, "fx")
+      .calls("h", 0, "fx");
+  JIT::profileUse = path;
+  TEST("function h(x) begin return x * 3 end function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin if (i > n) then s := s + h(i) else s := s + i; i := i + 1 end return s end function f() fx(10)")
+      .run(45)
+      .weights(2, "fx")
+      .calls("h", 1, "fx");
+  // the profile does not match a changed program, which is compiled without it
+  TEST("function fx(n) begin var i; i := 0; while (i < n) do i := i + 2; return i end function f() fx(10)")
+      .run(10)
+      .weights(0, "fx");
+  JIT::passes = "";
+  JIT::profileUse = "";
+  profile::reset();
+  std::remove(path);
+}
+
+void test_tiering() {
+  std::cout << "Tiered compilation..." << std::endl;
+  JIT::tiered = true;
+  JIT::hotCalls = 10;
+  // the results must not depend on when the functions are switched to their optimized code
+  TEST("function g(x) x * 2 function f() begin var i, s; i := 0; s := 0; while (i < 1000) do begin s := s + g(i); i := i + 1 end return s end")
+      .run(999000);
+  // both tiers share the globals
+  TEST("function g(x) begin n := n + x; return n end function f() begin var i; i := 0; while (i < 1000) do begin g(1); i := i + 1 end return n end var n")
+      .run(1000);
+  TEST("function fib(n) begin if (n < 2) then return n; return fib(n - 1) + fib(n - 2) end function f() fib(20)")
+      .run(6765);
+  // the baseline is not optimized, it only counts the calls and reports the hot one
+  TEST("function f() begin var i; i := 0; while (i < 100) do i := i + 1; return i end")
+      .run(100)
+      .containsSingle("call", "f")
+      .containsSingle("call", "main");
+  // the loops of main are continued in the optimized code, with the locals passed and the globals shared
+  JIT::hotIterations = 100;
+  PROGRAM("begin var i, s; i := 0; s := 0; while (i < 10000) do begin s := s + i / 100; i := i + 1 end return s end")
+      .run(495000);
+  PROGRAM("var x, y; begin x := 566000; y := 234; while (x <> y) do if (x > y) then x := x - y else y := y - x; return x end")
+      .run(2);
+  PROGRAM("var n; begin var i, j; n := 0; i := 0; while (i < 300) do begin j := 0; while (j < i) do begin n := n + 1; j := j + 1 end i := i + 1 end return n end")
+      .run(44850);
+  JIT::finish();
+  JIT::tiered = false;
+  JIT::hotCalls = 1000;
+  JIT::hotIterations = 10000;
+}
+
 void test_peephole() {
   std::cout << "Peepholer..." << std::endl;
   TEST("function ff(a) a * 4 function f() ff(10)")
@@ -599,11 +1011,24 @@ void test_inlining() {
       .containsSingle("call","fx");
   TEST("function fx() 1 function f() fx()")
       .run(1)
-      .containsSingle("call");
+      .containsNot("call");
+  TEST("function gcd(a, b) begin if (b = 0) then return a; return gcd(b, a - (a / b) * b) end function f() gcd(12, 18)")
+      .run(6)
+      .containsSingle("call", "gcd");
+  // functions must be declared before they are called, so recursion cannot go through another function
+  TEST("function fx(a) begin if (a > 0) then return fx(a - 1) + 1; return 0 end function gx(a) fx(a) function f() gx(5)")
+      .run(5)
+      .calls("fx", 1, "fx");
 }
 
 void test_unrolling() {
   std::cout << "Loop unrolling..." << std::endl;
+  TEST("function f() begin var i, s; i := 0; s := 0; while (i < 4) do begin s := s + i; i := i + 1 end return s end")
+      .run(6);
+  TEST("function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin s := s + i; i := i + 1 end return s end function f() fx(7)")
+      .run(21);
+  TEST("function fx(n) begin var i, s; i := 0; s := 0; while (i < n) do begin s := s + i; i := i + 1 end return s end function f() fx(0)")
+      .run(0);
 }
 
 
@@ -639,9 +1064,25 @@ void tests() {
   //test_cp();
   test_die();
   test_dce();
+  test_mem2reg();
+  test_globals();
+  test_vrp();
+  test_reassociate();
+  test_threading();
+  test_gvn();
+  test_ipcp();
+  test_specialization();
+  test_attributes();
+  test_memoize();
+  test_pipelines();
+  test_licm();
+  test_indvars();
+  test_rotation();
+  test_profile();
+  test_tiering();
   //test_peephole();
-  //test_inlining();
-  //test_unrolling();
+  test_inlining();
+  test_unrolling();
   //test_tailRecursion();
 
   Test::stats();